@@ -25,6 +25,16 @@
 
 # Directory blocks can have up to 1023 things in it (that's a lot!)
 
+# -----------------------
+# Version 2 directory blocks
+
+# Same as above but the magic number is 0xdeadd152 and the dentries are sorted by name
+# The block right after a v2 directory block is its hash index:
+# 2048 little endian shorts, a name goes in slot (hash % 2048), or the next empty one after that (wrapping around)
+# hash is 32 bit FNV-1a of the name
+# Each slot is (tag << 10) | (position of the dentry in the directory block + 1), 0 means empty
+# tag is the 6 bits of the hash right after the ones used for the slot ((hash >> 11) & 0x3f)
+
 # -----------------------
 # Fentry
 # Each Fentry can be up to ~4 MB (just a little less than that)
@@ -37,6 +47,16 @@
 # Next 4 bytes are the number of valid entries in this fentry
 # The rest are pointers to data blocks
 
+# -----------------------
+# Extent fentry (version 3)
+
+# Bytes 0-3: Magic number 0xdeadda7e
+# Bytes 4-7: Number of extents
+# Then a 64-byte name buffer
+# Then 4 bytes of file size
+# Then the extents, each is 2 longs: first data block index, number of blocks
+# The data blocks of an extent are consecutive and have no size header (all 4096 bytes are data)
+
 # -----------------------
 # Data block
 #
@@ -57,6 +77,23 @@ BLOCK_SIZE = 4096 # 4096
 # Magicnum for directory block
 JPRX_FS_MAGICNUM_DIR = 0xdeadd150
 
+# Magicnum for version 2 (sorted + hash index) directory block
+JPRX_FS_MAGICNUM_DIR2 = 0xdeadd152
+
+# Magicnum for extent fentry
+JPRX_FS_MAGICNUM_EXT = 0xdeadda7e
+
+# Which format to write:
+# 1: original
+# 2: sorted + hash index directories
+# 3: 2 with extent fentries
+FS_VERSION = 3
+
+# Hash index of version 2 directories:
+DIR_INDEX_SLOTS = BLOCK_SIZE // 2
+DIR_INDEX_SLOT_BITS = 11
+DIR_INDEX_POS_BITS = 10
+
 # Magicnum for data block
 JPRX_FS_MAGICNUM_DAT = 0xdeadda7a
 
@@ -85,8 +122,9 @@ class DataBlock():
     def set_contents(self, content):
         self.contents = content
 
-    def __init__(self):
+    def __init__(self, headerless=False):
         self.contents = 0
+        self.headerless = headerless
 
     def set_idx(self, my_index, parent_index):
         self.my_index = my_index
@@ -97,7 +135,8 @@ class DataBlock():
 
     def calculate_bytes(self):
         self.bytes = bytearray()
-        self.bytes += struct.pack("<I", len(self.contents))
+        if (not self.headerless):
+            self.bytes += struct.pack("<I", len(self.contents))
         self.bytes += self.contents
         
         for x in range(BLOCK_SIZE - len(self.bytes)):
@@ -128,11 +167,16 @@ class Fentry():
             print("File {} is too big!".format(self.sys_path))
             exit(-1)
         file = open(self.sys_path, "rb")
+        self.file_size = file_size
 
-        self.num_blocks = math.ceil(file_size / BLOCK_SIZE)
+        # Extent fentries don't need the 4 byte size header in each block
+        headerless = FS_VERSION >= 3
+        block_data_size = BLOCK_SIZE if headerless else BLOCK_SIZE - 4
+
+        self.num_blocks = math.ceil(file_size / block_data_size)
         for i in range(self.num_blocks):
-            data_block = DataBlock()
-            data_block.set_contents(file.read(BLOCK_SIZE - 4))
+            data_block = DataBlock(headerless)
+            data_block.set_contents(file.read(block_data_size))
             data_block.set_idx(len(blocks), self.my_index)
             blocks.append(data_block)
             self.data_blocks.append(data_block.my_index)
@@ -144,11 +188,26 @@ class Fentry():
     def __str__(self):
         return "{} Fentry {}\n\tData blocks ({}): {}".format(self.my_index, self.name, len(self.data_blocks), self.data_blocks)
 
+    # Runs of consecutive data blocks as [first block, number of blocks]
+    # (create_data_blocks lays a file out in one go so this is normally just one)
+    def extents(self):
+        runs = []
+        for b in self.data_blocks:
+            if (len(runs) > 0 and runs[-1][0] + runs[-1][1] == b):
+                runs[-1][1] += 1
+            else:
+                runs.append([b, 1])
+        return runs
+
     def calculate_bytes(self):
         # Start with magic number
         self.bytes = bytearray()
-        self.bytes += struct.pack("<I", JPRX_FS_MAGICNUM_DAT)
-        self.bytes += struct.pack("<I", len(self.data_blocks))
+        if (FS_VERSION >= 3):
+            self.bytes += struct.pack("<I", JPRX_FS_MAGICNUM_EXT)
+            self.bytes += struct.pack("<I", len(self.extents()))
+        else:
+            self.bytes += struct.pack("<I", JPRX_FS_MAGICNUM_DAT)
+            self.bytes += struct.pack("<I", len(self.data_blocks))
         
         # Name:
         name_counter = 0
@@ -162,14 +221,51 @@ class Fentry():
             else:
                 self.bytes += b'\x00'
 
-        # Subdirs:
-        for b in self.data_blocks:
-            self.bytes += struct.pack("<I", b)
+        if (FS_VERSION >= 3):
+            self.bytes += struct.pack("<I", self.file_size)
+            for start, length in self.extents():
+                self.bytes += struct.pack("<II", start, length)
+        else:
+            # Subdirs:
+            for b in self.data_blocks:
+                self.bytes += struct.pack("<I", b)
 
         # Fill in rest of data:
         for x in range(BLOCK_SIZE - len(self.bytes)):
             self.bytes += b'\xff'
 
+# FNV-1a, has to match filesys_name_hash in the kernel
+def name_hash(name):
+    h = 2166136261
+    for c in name.encode('ASCII'):
+        h ^= c
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+class DirIndexBlock():
+    """Hash index of the (version 2) directory block right before it"""
+
+    def __init__(self, dir_block):
+        self.dir_block = dir_block
+        self.my_index = dir_block.my_index + 1
+
+    def __str__(self):
+        return "{} Hash index for directory {}".format(self.my_index, self.dir_block.name)
+
+    def calculate_bytes(self):
+        slots = [0] * DIR_INDEX_SLOTS
+        for pos, idx in enumerate(self.dir_block.sorted_entries()):
+            h = name_hash(blocks[idx].name)
+            slot = h % DIR_INDEX_SLOTS
+            tag = (h >> DIR_INDEX_SLOT_BITS) & ((1 << (16 - DIR_INDEX_POS_BITS)) - 1)
+            while (slots[slot] != 0):
+                slot = (slot + 1) % DIR_INDEX_SLOTS
+            slots[slot] = (tag << DIR_INDEX_POS_BITS) | (pos + 1)
+
+        self.bytes = bytearray()
+        for x in slots:
+            self.bytes += struct.pack("<H", x)
+
 class DirectoryBlock():
     name = ""
 
@@ -205,12 +301,18 @@ class DirectoryBlock():
     def __str__(self):
         return "{}: Directory {}\n\tSubdirs: {}\n\tFiles: {}".format(self.my_index, self.name, self.dentries, self.fentries)
 
+    # Every dentry, in the order they go in the block
+    def sorted_entries(self):
+        if (FS_VERSION < 2):
+            return self.dentries + self.fentries
+        return sorted(self.dentries + self.fentries, key=lambda idx: blocks[idx].name.encode('ASCII'))
+
     def calculate_bytes(self):
         # Don't forget x86 is little endian
 
         # Start with magic number
         self.bytes = bytearray()
-        self.bytes += struct.pack("<I", JPRX_FS_MAGICNUM_DIR)
+        self.bytes += struct.pack("<I", JPRX_FS_MAGICNUM_DIR if FS_VERSION < 2 else JPRX_FS_MAGICNUM_DIR2)
         self.bytes += struct.pack("<I", len(self.dentries) + len(self.fentries))
         
         # Name:
@@ -225,13 +327,9 @@ class DirectoryBlock():
             else:
                 self.bytes += b'\x00'
 
-        # Subdirs:
-        for dentry in self.dentries:
-            self.bytes += struct.pack("<I", dentry)
-
-        # Fentry pointers:
-        for fentry in self.fentries:
-            self.bytes += struct.pack("<I", fentry)
+        # Subdirs and fentry pointers:
+        for entry in self.sorted_entries():
+            self.bytes += struct.pack("<I", entry)
 
         # Fill in rest of data:
         for x in range(BLOCK_SIZE - len(self.bytes)):
@@ -282,6 +380,8 @@ def gen_blocks():
         this_block = DirectoryBlock(dir_name, os.path.basename(dir_name))
         this_block.set_index(len(blocks))
         blocks.append(this_block)
+        if (FS_VERSION >= 2):
+            blocks.append(DirIndexBlock(this_block))
 
         subdir_full_list = []
         for subdir in subdir_list:
@@ -30,6 +30,18 @@
 // Sandbox related
 #define SYS_SANDBOX_EXIT 14
 
+// Time related
+#define SYS_CLOCK_GETTIME 15
+
+// Memory related (continued)
+#define SYS_MUNMAP 16
+
+// Process operations (continued)
+#define SYS_FORK 17
+
+// Memory related (continued)
+#define SYS_BRK 18
+
 int syscall(int num, ...) {
     int *args = (int *)&num;
     int retval;
@@ -62,6 +74,11 @@ int execute(char *file) {
     return syscall(SYS_EXEC, file);
 }
 
+// Returns the child's PID in the parent, 0 in the child (-1 on failure)
+int fork() {
+    return syscall(SYS_FORK);
+}
+
 int open(char *file) {
     return syscall(SYS_OPEN, file);
 }
@@ -90,6 +107,8 @@ int alert(char *message) {
 
 // Options for envconfig:
 #define ENV_CONFIG_HIDE_CHARS ((0))
+#define ENV_CONFIG_TICK_RATE ((2)) /* Superuser only, Hz */
+#define ENV_CONFIG_TIME_SLICE ((3)) /* Superuser only, ms */
 int env_config(unsigned int code, unsigned int val) {
     return syscall(SYS_ENVCONFIG, code, val);
 }
@@ -117,8 +136,35 @@ int remote_switch_user(int pid) {
     return syscall(SYS_REMOTE_SWITCHUSER, pid);
 }
 
+/* One 4MB page at 0x0D048000, only once */
 int mmap() {
-    return syscall(SYS_MMAP);
+    return syscall(SYS_MMAP, 0, 0, 0);
+}
+
+// Protections for mmap_region:
+#define PROT_NONE ((0))
+#define PROT_READ ((1))
+#define PROT_WRITE ((2))
+
+/* len bytes (zeroed), at hint if it's free. Multiples of 4MB get huge pages */
+int mmap_region(void *hint, unsigned int len, int prot) {
+    return syscall(SYS_MMAP, hint, len, prot);
+}
+
+int munmap(void *addr, unsigned int len) {
+    return syscall(SYS_MUNMAP, addr, len);
+}
+
+// Move the end of the heap to addr (NULL just asks), returns the new end (the old one on failure)
+void *brk(void *addr) {
+    return (void *)syscall(SYS_BRK, addr);
+}
+
+// Grow (or shrink) the heap by increment bytes, returns the start of the new space ((void *)-1 on failure)
+void *sbrk(int increment) {
+    char *old_end = brk(0);
+    if (brk(old_end + increment) != old_end + increment) return (void *)-1;
+    return old_end;
 }
 
 #define clear_screen() do { \
@@ -16,8 +16,8 @@ typedef unsigned short uint16_t;
 typedef short int16_t;
 typedef unsigned int uint32_t;
 typedef int int32_t;
-typedef unsigned long uint64_t;
-typedef long int64_t;
+typedef unsigned long long uint64_t;
+typedef long long int64_t;
 typedef uint32_t size_t;
 
 /*
@@ -221,4 +221,65 @@ int strlen(char *str) {
     return i;
 }
 
-#endif
\ No newline at end of file
+// Time
+// The kernel maps a read-only page at TIME_PAGE_ADDR into every process (see the kernel's clock.h)
+// Reading the time off of it doesn't need a syscall
+#define TIME_PAGE_ADDR ((0x0C000000))
+#define CLOCK_MONOTONIC ((0))
+
+typedef struct {
+    uint32_t tsc_ok;
+    uint32_t tsc_mult;
+    uint32_t tsc_shift;
+    uint32_t tsc_khz;
+    uint64_t tsc_base;
+} time_page_t;
+
+typedef struct {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Ask the kernel for the time
+int clock_gettime_syscall(int clock_id, timespec_t *ts) {
+    return syscall(SYS_CLOCK_GETTIME, clock_id, ts);
+}
+
+// Nanoseconds since boot
+uint64_t clock_ns() {
+    time_page_t *t = (time_page_t *)TIME_PAGE_ADDR;
+    if (t->tsc_ok) {
+        // (delta * mult) >> shift, split up so it doesn't overflow
+        uint64_t delta = rdtsc() - t->tsc_base;
+        uint64_t lo = ((uint64_t)(uint32_t)delta * t->tsc_mult) >> t->tsc_shift;
+        uint64_t hi = ((uint64_t)(uint32_t)(delta >> 32) * t->tsc_mult) << (32 - t->tsc_shift);
+        return hi + lo;
+    }
+
+    timespec_t ts;
+    clock_gettime_syscall(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Same as the syscall, but uses the time page when it can
+int clock_gettime(int clock_id, timespec_t *ts) {
+    time_page_t *t = (time_page_t *)TIME_PAGE_ADDR;
+    if (clock_id != CLOCK_MONOTONIC || !t->tsc_ok) {
+        return clock_gettime_syscall(clock_id, ts);
+    }
+
+    uint64_t ns = clock_ns();
+    uint32_t sec, nsec;
+    asm ("divl %4" : "=a"(sec), "=d"(nsec) : "a"((uint32_t)ns), "d"((uint32_t)(ns >> 32)), "rm"(1000000000));
+    ts->tv_sec = sec;
+    ts->tv_nsec = nsec;
+    return 0;
+}
+
+#endif
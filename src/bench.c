@@ -0,0 +1,321 @@
+#include "bench.h"
+#include "util.h"
+#include "process.h"
+#include "scheduler.h"
+#include "clock.h"
+#include "fpu.h"
+#include "kmalloc.h"
+#include "paging.h"
+#include "gui.h"
+#include "vga.h"
+#include "filesystem.h"
+
+static char bench_results[BENCH_RESULTS_SIZE];
+static size_t bench_results_len = 0;
+
+void bench_record(char *line) {
+    bench_results_len += strncpy(bench_results + bench_results_len, line, BENCH_RESULTS_SIZE - bench_results_len);
+}
+
+size_t bench_report(char *buf, size_t size) {
+    if (bench_results_len == 0) {
+        return strncpy(buf, "No benchmarks have run (see BENCHMARK_ON_BOOT)\n", size);
+    }
+    return strncpy(buf, bench_results, size);
+}
+
+// ns per operation
+static uint32_t _bench_ns_per(uint64_t total_ns, uint32_t ops) {
+    if (ops == 0) return 0;
+    return div_u64_u32(total_ns, ops, NULL);
+}
+
+/*******************
+ * Context switch
+ *******************/
+
+// Switches each worker does:
+#define BENCH_SWITCH_ROUNDS ((10000))
+
+static volatile uint32_t switch_workers_ready;
+static volatile uint32_t switch_workers_done;
+static volatile bool switch_go;
+static volatile bool switch_waiting;
+static uint32_t switch_fpu_mask; // Bit n set = worker n uses the FPU every round
+static uint32_t switch_as_mask; // Bit n set = worker n gets its own page directory
+static uint64_t switch_start_ns;
+static uint64_t switch_end_ns;
+
+// Clobber an FPU register so we own the FPU
+static inline void _bench_touch_fpu() {
+    if (fpu_sse_enabled()) {
+        asm volatile ("xorps %xmm0, %xmm0");
+    }
+    else {
+        asm volatile ("fldz\n" "fstp %st(0)\n");
+    }
+}
+
+// Two of these ping-pong the CPU back and forth with scheduler_yield
+static void _bench_switch_worker() {
+    sti();
+    uint32_t id = switch_workers_ready++;
+    bool use_fpu = (switch_fpu_mask >> id) & 0x01;
+
+    // Kernel processes share the kernel's page directory, give this one its own
+    // so switching to it costs a CR3 write (process_destroy frees it)
+    if ((switch_as_mask >> id) & 0x01) {
+        if (as_create(&current_proc->as)) {
+            as_switch(&current_proc->as);
+        }
+    }
+
+    // Wait for both workers, and for bench_main to get off the run queue
+    while (!switch_go) { scheduler_yield(); }
+    if (0 == switch_start_ns) {
+        switch_start_ns = clock_ns();
+    }
+
+    uint32_t i;
+    for (i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        if (use_fpu) _bench_touch_fpu();
+        scheduler_yield();
+    }
+
+    switch_workers_done++;
+    if (switch_workers_done == 2) {
+        switch_end_ns = clock_ns();
+        switch_waiting = false;
+        sched_wake_flags();
+    }
+    sysret(0);
+}
+
+static void _bench_switch_run(uint32_t fpu_mask, uint32_t as_mask, char *label) {
+    switch_workers_ready = 0;
+    switch_workers_done = 0;
+    switch_go = false;
+    switch_fpu_mask = fpu_mask;
+    switch_as_mask = as_mask;
+    switch_start_ns = 0;
+    switch_end_ns = 0;
+
+    uint32_t traps = fpu_num_traps;
+    uint32_t saves = fpu_num_saves;
+
+    execute_kern_nonblocking(_bench_switch_worker, 0, "bench_switch0");
+    execute_kern_nonblocking(_bench_switch_worker, 0, "bench_switch1");
+
+    // Let them go, and sleep until they are both done:
+    switch_waiting = true;
+    switch_go = true;
+    sched_wait_flag(&switch_waiting);
+
+    char linebuf[128];
+    snprintf(linebuf, sizeof(linebuf), "switch (%s): %u ns/switch, %u #NM, %u FXSAVEs\n", label,
+        _bench_ns_per(switch_end_ns - switch_start_ns, 2 * BENCH_SWITCH_ROUNDS),
+        fpu_num_traps - traps, fpu_num_saves - saves);
+    bench_record(linebuf);
+}
+
+// Context switch cost with no, one and two processes using the FPU
+// With lazy switching only the last one should pay for FXSAVE/ FXRSTOR
+// Then the same with the two processes in different address spaces, which is what
+// switching between user processes costs (a CR3 write and the TLB refill after it)
+static void bench_switch() {
+    _bench_switch_run(0x00, 0x00, "no FPU users");
+    _bench_switch_run(0x01, 0x00, "1 FPU user");
+    _bench_switch_run(0x03, 0x00, "2 FPU users");
+    _bench_switch_run(0x00, 0x03, "2 address spaces");
+}
+
+/*******************
+ * kmalloc
+ *******************/
+
+// Live allocations at once, and how many alloc/ free operations to do on them:
+#define BENCH_KMALLOC_SLOTS ((4096))
+#define BENCH_KMALLOC_OPS ((100000))
+
+static void *kmalloc_slots[BENCH_KMALLOC_SLOTS];
+
+// Mixed workload: each op picks a random slot, frees it if it's taken or fills it with
+// a random size otherwise. Sizes are mostly small with the occasional page sized one.
+static void bench_kmalloc() {
+    uint32_t i, ops = 0;
+    uint32_t seed = 0x1234567;
+    uint32_t peak_in_use = 0, peak_reserved = 0;
+
+    for (i = 0; i < BENCH_KMALLOC_SLOTS; i++) {
+        kmalloc_slots[i] = NULL;
+    }
+
+    uint64_t start_ns = clock_ns();
+    for (i = 0; i < BENCH_KMALLOC_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t slot = (seed >> 8) % BENCH_KMALLOC_SLOTS;
+
+        if (kmalloc_slots[slot]) {
+            kfree(kmalloc_slots[slot]);
+            kmalloc_slots[slot] = NULL;
+        }
+        else {
+            seed = seed * 1103515245 + 12345;
+            uint32_t size = ((seed >> 16) & 0x0F) ? (1 + ((seed >> 4) & 0x1FF)) : (1 + ((seed >> 4) & 0xFFF));
+            kmalloc_slots[slot] = kmalloc(size);
+        }
+        ops++;
+
+        // Sample the footprint now and then (summing up the caches isn't free)
+        if (0 == (i & 0x3FF)) {
+            uint32_t in_use = kmalloc_bytes_in_use();
+            if (in_use > peak_in_use) {
+                peak_in_use = in_use;
+                peak_reserved = kmalloc_bytes_reserved();
+            }
+        }
+    }
+    uint64_t end_ns = clock_ns();
+
+    char linebuf[128];
+    snprintf(linebuf, sizeof(linebuf), "kmalloc: %u ns/op, peak %u kB in use of %u kB of slabs/ pages\n",
+        _bench_ns_per(end_ns - start_ns, ops), peak_in_use / 1024, peak_reserved / 1024);
+    bench_record(linebuf);
+
+    for (i = 0; i < BENCH_KMALLOC_SLOTS; i++) {
+        kfree(kmalloc_slots[i]);
+        kmalloc_slots[i] = NULL;
+    }
+}
+
+/*******************
+ * Framebuffer blits
+ *******************/
+
+// Full screen copies (what gui_redraw does) per run:
+#define BENCH_BLIT_FRAMES ((64))
+
+// Map the framebuffer with the default memory type or write-combining, then blit to it
+// Returns MB/s
+static uint32_t _bench_blit_run(bool write_combining) {
+    uint32_t i;
+    if (write_combining) {
+        map_huge_page_kern_wc((uint32_t)videomem, (uint32_t)videomem);
+        map_huge_page_kern_wc((uint32_t)videomem + HUGE_PAGE_SIZE, (uint32_t)videomem + HUGE_PAGE_SIZE);
+    }
+    else {
+        map_huge_page_kern((uint32_t)videomem, (uint32_t)videomem);
+        map_huge_page_kern((uint32_t)videomem + HUGE_PAGE_SIZE, (uint32_t)videomem + HUGE_PAGE_SIZE);
+    }
+
+    uint64_t start_ns = clock_ns();
+    for (i = 0; i < BENCH_BLIT_FRAMES; i++) {
+        memcpy(videomem, framebuffer, SCREEN_SIZE * sizeof(*videomem));
+    }
+    uint64_t end_ns = clock_ns();
+
+    // Bytes per us is MB/s:
+    uint32_t us = div_u64_u32(end_ns - start_ns, 1000, NULL);
+    if (us == 0) return 0;
+    return div_u64_u32((uint64_t)BENCH_BLIT_FRAMES * SCREEN_SIZE * sizeof(*videomem), us, NULL);
+}
+
+static void bench_blit() {
+    char linebuf[128];
+    if (!vga_use_highres_gui) {
+        bench_record("blit: no framebuffer\n");
+        return;
+    }
+
+    uint32_t default_mbps = _bench_blit_run(false);
+    uint32_t wc_mbps = _bench_blit_run(true);
+
+    snprintf(linebuf, sizeof(linebuf), "blit: %u MB/s default, %u MB/s write-combining%s\n",
+        default_mbps, wc_mbps, paging_has_pat() ? "" : " (no PAT, same mapping)");
+    bench_record(linebuf);
+}
+
+/*******************
+ * Filesystem reads
+ *******************/
+
+// Biggest file we ship, and how many times to read it:
+#define BENCH_FS_READ_FILE "/prot/images/background.bmp"
+#define BENCH_FS_READ_PASSES ((8))
+
+// Read all of file into buf BENCH_FS_READ_PASSES times, chunk bytes per filesys_read_bytes, returns MB/s
+static uint32_t _bench_fs_read_run(xentry *file, int8_t *buf, size_t file_size, size_t chunk) {
+    uint32_t i;
+    size_t offset;
+
+    uint64_t start_ns = clock_ns();
+    for (i = 0; i < BENCH_FS_READ_PASSES; i++) {
+        for (offset = 0; offset < file_size; offset += chunk) {
+            filesys_read_bytes(file, offset, buf + offset, chunk);
+        }
+    }
+    uint64_t end_ns = clock_ns();
+
+    // Bytes per us is MB/s:
+    uint32_t us = div_u64_u32(end_ns - start_ns, 1000, NULL);
+    if (us == 0) return 0;
+    return div_u64_u32((uint64_t)BENCH_FS_READ_PASSES * file_size, us, NULL);
+}
+
+static void bench_fs_read() {
+    char linebuf[128];
+    xentry *file = filesys_lookup(BENCH_FS_READ_FILE);
+    if (!file || !filesys_is_file(file)) {
+        bench_record("fs read: no "BENCH_FS_READ_FILE"\n");
+        return;
+    }
+
+    // Files are under 4MB (the whole image is), so reading 4MB tells us its size:
+    int8_t *buf = kmalloc(HUGE_PAGE_SIZE);
+    if (!buf) {
+        bench_record("fs read: out of memory\n");
+        return;
+    }
+    size_t file_size = filesys_read_bytes(file, 0, buf, HUGE_PAGE_SIZE);
+
+    uint32_t whole_mbps = _bench_fs_read_run(file, buf, file_size, file_size);
+    uint32_t page_mbps = _bench_fs_read_run(file, buf, file_size, FS_BLOCK_SIZE);
+    kfree(buf);
+
+    snprintf(linebuf, sizeof(linebuf), "fs read: %u MB/s whole file, %u MB/s in 4kb reads (%u kB x %u, %s)\n",
+        whole_mbps, page_mbps, file_size / 1024, BENCH_FS_READ_PASSES,
+        file->magicnum == FS_EXT_MAGIC ? "extents" : "blocks");
+    bench_record(linebuf);
+}
+
+/*******************
+ * Entrypoint
+ *******************/
+
+typedef void (*bench_t)(void);
+
+// Every benchmark, run in this order:
+static bench_t benchmarks[] = {
+    bench_switch,
+    bench_kmalloc,
+    bench_blit,
+    bench_fs_read,
+};
+
+#define NUM_BENCHMARKS ((sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+void bench_main() {
+    sti();
+    uint32_t i;
+
+    bench_results_len = 0;
+    char linebuf[64];
+    snprintf(linebuf, sizeof(linebuf), "TSC: %u kHz\n", clock_tsc_khz());
+    bench_record(linebuf);
+
+    for (i = 0; i < NUM_BENCHMARKS; i++) {
+        benchmarks[i]();
+    }
+
+    sysret(0);
+}
@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include "types.h"
+
+// Kernel benchmarks
+// Set BENCHMARK_ON_BOOT in defines.h to run them all at boot.
+// Each benchmark records a line of results, which can be read back from /proc/bench.
+
+// Max size of all results put together:
+#define BENCH_RESULTS_SIZE ((2048))
+
+/*
+ * bench_main
+ *
+ * Kernel thread that runs every benchmark and then exits.
+ * Launch it with execute_kern_blocking.
+ */
+void bench_main(void);
+
+// Append a line to the results
+void bench_record(char *line);
+
+// Copy the results into buf (for /proc/bench), returns bytes written
+size_t bench_report(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,107 @@
+#include "clock.h"
+#include "util.h"
+#include "pit.h"
+#include "paging.h"
+
+// Length of each calibration run (PIT counts, ~20ms), and how many runs to take the best of
+#define CALIBRATE_COUNTS ((23864))
+#define CALIBRATE_RUNS ((3))
+
+// The time page has to be alone in its own 4kb page, since all of it is visible to userspace
+static union {
+    time_page_t time;
+    uint8_t pad[PAGE_SIZE];
+} time_page __attribute__((aligned(PAGE_SIZE)));
+
+// Time counted off PIT ticks, for when there's no TSC (see clock_account_ticks):
+static volatile uint64_t clock_tick_ns = 0;
+
+// Does this CPU have a TSC? (CPUID leaf 1, EDX bit 4)
+static bool _has_tsc() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 4) & 0x01;
+}
+
+// Count TSC cycles across CALIBRATE_COUNTS of PIT channel 2
+// Channel 0 is busy being the scheduler tick, channel 2 can be gated and polled without interrupts
+static uint32_t _calibrate_once() {
+    uint8_t gate = inb(PIT_CH2_GATE_PORT);
+
+    // Gate off while programming, speaker off the whole time:
+    outb(PIT_CH2_GATE_PORT, gate & ~(PIT_CH2_GATE | PIT_CH2_SPEAKER));
+    outb(PIT_CMD, PIT_CMD_CH2_ONESHOT);
+    outb(PIT_CHANNEL2, CALIBRATE_COUNTS & 0x0FF);
+    outb(PIT_CHANNEL2, (CALIBRATE_COUNTS >> 8) & 0x0FF);
+
+    // Raise the gate to start counting, then wait for the output to go high (terminal count)
+    outb(PIT_CH2_GATE_PORT, (gate & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_CH2_GATE_PORT) & PIT_CH2_OUT)) {}
+    uint64_t end = rdtsc();
+
+    outb(PIT_CH2_GATE_PORT, gate);
+    return (uint32_t)(end - start);
+}
+
+void init_clock() {
+    time_page_t *t = &time_page.time;
+    memset((char *)&time_page, 0, sizeof(time_page));
+
+    if (_has_tsc()) {
+        // Take the shortest run, anything longer got interrupted somehow (SMI, host preempting us, ...)
+        uint32_t i, cycles = 0xFFFFFFFF;
+        for (i = 0; i < CALIBRATE_RUNS; i++) {
+            uint32_t run = _calibrate_once();
+            if (run < cycles) cycles = run;
+        }
+
+        // khz = cycles / (CALIBRATE_COUNTS / PIT_BASE_FREQ seconds) / 1000
+        uint32_t khz = div_u64_u32((uint64_t)cycles * PIT_BASE_FREQ, CALIBRATE_COUNTS * 1000, NULL);
+
+        // Below ~1MHz tsc_mult wouldn't fit in 32 bits (and the TSC probably isn't worth using anyways)
+        if (khz > 1000) {
+            t->tsc_khz = khz;
+            t->tsc_shift = CLOCK_TSC_SHIFT;
+            t->tsc_mult = div_u64_u32((uint64_t)1000000 << CLOCK_TSC_SHIFT, khz, NULL);
+            t->tsc_base = rdtsc();
+            t->tsc_ok = true;
+        }
+    }
+
+    // Goes in the kernel page directory as a user page, so every address space gets it too
+    // (kernel entries are copied into the live one by _kernel_pde_changed, and into the rest by as_switch):
+    map_page(TIME_PAGE_VIRT_ADDR, (uint32_t)&time_page, true, false);
+}
+
+uint64_t clock_ns() {
+    time_page_t *t = &time_page.time;
+    if (t->tsc_ok) {
+        return mul_u64_u32_shr(rdtsc() - t->tsc_base, t->tsc_mult, t->tsc_shift);
+    }
+
+    // No TSC, all we have is the tick count (64 bits doesn't read atomically):
+    uint32_t flags = cli_and_save();
+    uint64_t ns = clock_tick_ns;
+    restore_flags(flags);
+    return ns;
+}
+
+void clock_account_ticks(uint32_t ticks) {
+    clock_tick_ns += (uint64_t)ticks * (1000000000 / pit_get_frequency());
+}
+
+uint32_t clock_tsc_khz() {
+    return time_page.time.tsc_ok ? time_page.time.tsc_khz : 0;
+}
+
+int32_t sys_clock_gettime(uint32_t clock_id, timespec_t *ts) {
+    if (!ts) return -1;
+    if (clock_id != CLOCK_MONOTONIC) return -1;
+
+    uint32_t nsec;
+    uint64_t ns = clock_ns();
+    ts->tv_sec = div_u64_u32(ns, 1000000000, &nsec);
+    ts->tv_nsec = nsec;
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+#include "types.h"
+
+// Monotonic clock
+// Counts nanoseconds since boot off the TSC, which is calibrated against the PIT at boot.
+// If there is no TSC this falls back to counting PIT ticks.
+
+// Where the time page is mapped (read-only) in every user process:
+#define TIME_PAGE_VIRT_ADDR ((0x0C000000))
+
+// How much tsc_mult is scaled up by:
+#define CLOCK_TSC_SHIFT ((22))
+
+// Clock IDs for SYS_CLOCK_GETTIME:
+#define CLOCK_MONOTONIC ((0))
+
+/*
+ * The time page
+ *
+ * Userspace can turn a TSC reading into ns with this, no syscall required:
+ *      ns = ((rdtsc() - tsc_base) * tsc_mult) >> tsc_shift
+ * Everything here is written once at boot and never changes after.
+ * If tsc_ok is 0, userspace has to use SYS_CLOCK_GETTIME instead.
+ */
+typedef struct {
+    uint32_t tsc_ok;
+    uint32_t tsc_mult;
+    uint32_t tsc_shift;
+    uint32_t tsc_khz;
+    uint64_t tsc_base;
+} time_page_t;
+
+// Userspace view of the time
+typedef struct {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+// Calibrate the TSC and map the time page (call with interrupts off, after paging and the PIT are setup)
+void init_clock(void);
+
+// Nanoseconds since boot
+uint64_t clock_ns(void);
+
+/*
+ * clock_account_ticks
+ *
+ * ticks PIT ticks went by at the current tick rate (called with interrupts off as they're counted).
+ * Without a TSC clock_ns is the sum of these, so changing the tick rate doesn't change time that already passed.
+ */
+void clock_account_ticks(uint32_t ticks);
+
+// TSC frequency (0 if the TSC isn't in use)
+uint32_t clock_tsc_khz(void);
+
+/*
+ * sys_clock_gettime
+ *
+ * Write the current time on clock clock_id into ts.
+ * Returns 0 on success, -1 for an unknown clock.
+ */
+int32_t sys_clock_gettime(uint32_t clock_id, timespec_t *ts);
+
+#endif
@@ -0,0 +1,91 @@
+#include "dcache.h"
+#include "util.h"
+
+typedef struct dcache_entry_t {
+    bool used;
+    xentry_idx parent;
+    xentry_idx child;
+    uint32_t name_len;
+    char name[FS_NAME_LEN];
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_ENTRIES];
+
+// Stats:
+static uint32_t dcache_hits = 0;
+static uint32_t dcache_negative_hits = 0;
+static uint32_t dcache_misses = 0;
+static uint32_t dcache_replaced = 0;
+
+// FNV-1a over the name, with the parent mixed in so the same name in different directories spreads out
+static inline uint32_t _dcache_slot(xentry_idx parent, char *name, size_t name_len) {
+    uint32_t hash = 2166136261 ^ (parent * 0x9E3779B1);
+    size_t i;
+    for (i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619;
+    }
+    return (hash ^ (hash >> 16)) & (DCACHE_ENTRIES - 1);
+}
+
+static inline bool _dcache_matches(dcache_entry_t *entry, xentry_idx parent, char *name, size_t name_len) {
+    size_t i;
+    if (!entry->used || entry->parent != parent || entry->name_len != name_len) return false;
+    for (i = 0; i < name_len; i++) {
+        if (entry->name[i] != name[i]) return false;
+    }
+    return true;
+}
+
+bool dcache_lookup(xentry_idx parent, char *name, size_t name_len, xentry_idx *child) {
+    if (name_len > FS_NAME_LEN) return false;
+    uint32_t flags = cli_and_save();
+    dcache_entry_t *entry = &dcache[_dcache_slot(parent, name, name_len)];
+
+    if (!_dcache_matches(entry, parent, name, name_len)) {
+        dcache_misses++;
+        restore_flags(flags);
+        return false;
+    }
+
+    if (entry->child == DCACHE_NEGATIVE) dcache_negative_hits++;
+    else dcache_hits++;
+    if (child) *child = entry->child;
+    restore_flags(flags);
+    return true;
+}
+
+void dcache_insert(xentry_idx parent, char *name, size_t name_len, xentry_idx child) {
+    if (name_len > FS_NAME_LEN) return;
+    uint32_t flags = cli_and_save();
+    dcache_entry_t *entry = &dcache[_dcache_slot(parent, name, name_len)];
+
+    if (entry->used && !_dcache_matches(entry, parent, name, name_len)) dcache_replaced++;
+    entry->used = true;
+    entry->parent = parent;
+    entry->child = child;
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len);
+    restore_flags(flags);
+}
+
+size_t dcache_report(char *buf, size_t size) {
+    char linebuf[256];
+    uint32_t i, used = 0, negative = 0;
+
+    uint32_t flags = cli_and_save();
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        if (!dcache[i].used) continue;
+        used++;
+        if (dcache[i].child == DCACHE_NEGATIVE) negative++;
+    }
+
+    uint32_t lookups = dcache_hits + dcache_negative_hits + dcache_misses;
+    uint32_t hit_rate = lookups ? ((dcache_hits + dcache_negative_hits) * 100) / lookups : 0;
+    snprintf(linebuf, sizeof(linebuf),
+        "hits: %u\nnegative hits: %u\nmisses: %u\nhit rate: %u percent\nreplaced: %u\nentries: %u/%u (%u negative)\n",
+        dcache_hits, dcache_negative_hits, dcache_misses, hit_rate, dcache_replaced,
+        used, DCACHE_ENTRIES, negative);
+    restore_flags(flags);
+    return strncpy(buf, linebuf, size);
+}
@@ -0,0 +1,35 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+#include "types.h"
+#include "filesystem.h"
+
+// Directory entry cache
+// Remembers what filesys_lookup found when it looked a name up in a directory, keyed by
+// (directory block index, name). Names that weren't there are remembered too (negative entries),
+// so looking up something that doesn't exist doesn't scan the whole directory every time either.
+// With it a full path lookup is one hash probe per path component.
+// The filesystem is read only so nothing ever goes stale, entries only get replaced on collision.
+
+// Number of slots in the table (power of 2), each slot holds one entry:
+#define DCACHE_ENTRIES ((256))
+
+// Child index of a negative entry (no such name in that directory):
+#define DCACHE_NEGATIVE ((0xFFFFFFFF))
+
+/*
+ * dcache_lookup
+ *
+ * Look up name (name_len bytes, no null terminator needed) in the directory at block parent.
+ * Returns true if it is cached and writes the child's block index to child,
+ * which is DCACHE_NEGATIVE if the name is known to not be there.
+ * Returns false if we don't know, scan the directory and dcache_insert what you find.
+ */
+bool dcache_lookup(xentry_idx parent, char *name, size_t name_len, xentry_idx *child);
+
+// Remember the result of looking name up in parent (child is DCACHE_NEGATIVE if it wasn't there)
+void dcache_insert(xentry_idx parent, char *name, size_t name_len, xentry_idx child);
+
+// Hit rates and occupancy (for /proc/dcache), returns bytes written
+size_t dcache_report(char *buf, size_t size);
+
+#endif
@@ -5,6 +5,14 @@
 // For some reason when using HVM on macOS, VGA graphics suck but high-res is super fast
 #define USE_HIGHRES_GRAPHICS ((1))
 
+// Set this to 1 to run the kernel benchmarks (bench.c) at boot, before launchd starts
+// Results can be read from /proc/bench
+#define BENCHMARK_ON_BOOT ((0))
+
+// Set this to 1 to fill kmalloc memory with 0xA5 when it's allocated and 0x6B when it's freed
+// (catches reading uninitialized or freed memory)
+#define KMALLOC_POISON ((0))
+
 // Mode 0 = 800x600
 // Mode 1 = 1024x768
 // Mode 2 = 1600x1200
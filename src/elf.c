@@ -0,0 +1,85 @@
+#include "elf.h"
+#include "util.h"
+#include "paging.h"
+
+bool elf_check_header(Elf32_Ehdr *ehdr) {
+    if (!ehdr) return false;
+
+    // Skip e_ident[0], that's the special mode byte
+    if (ehdr->e_ident[1] != 'E' || ehdr->e_ident[2] != 'L' || ehdr->e_ident[3] != 'F') return false;
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS32) return false;
+    if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB) return false;
+    if (ehdr->e_type != ET_EXEC) return false;
+    if (ehdr->e_machine != EM_386) return false;
+    if (ehdr->e_phentsize != sizeof(Elf32_Phdr)) return false;
+    if (ehdr->e_phnum == 0 || ehdr->e_phnum > ELF_MAX_PHDRS) return false;
+    return true;
+}
+
+// Does [addr, addr + size) fit within [start, end)?
+static inline bool _elf_fits(uint32_t addr, uint32_t size, uint32_t start, uint32_t end) {
+    if (addr < start || addr >= end) return false;
+    return size <= end - addr;
+}
+
+int32_t elf_parse(xentry *file, uint32_t load_start, uint32_t load_end, elf_image_t *image) {
+    Elf32_Ehdr ehdr;
+    Elf32_Phdr phdrs[ELF_MAX_PHDRS];
+    uint32_t i;
+
+    if (!file || !image) return -1;
+
+    if (sizeof(ehdr) != filesys_read_bytes(file, 0, (int8_t *)&ehdr, sizeof(ehdr))) return -1;
+    if (!elf_check_header(&ehdr)) return -1;
+
+    size_t phdrs_size = ehdr.e_phnum * sizeof(Elf32_Phdr);
+    if (phdrs_size != filesys_read_bytes(file, ehdr.e_phoff, (int8_t *)phdrs, phdrs_size)) return -1;
+
+    uint32_t start = load_end;
+    uint32_t end = load_start;
+    image->num_segments = 0;
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type != PT_LOAD) continue;
+        if (phdrs[i].p_filesz > phdrs[i].p_memsz) return -1;
+        if (!_elf_fits(phdrs[i].p_vaddr, phdrs[i].p_memsz, load_start, load_end)) return -1;
+
+        // The file backed part has to actually be in the file (it's read a page at a time later):
+        int8_t probe;
+        if (phdrs[i].p_filesz > 0 && 1 != filesys_read_bytes(file, phdrs[i].p_offset + phdrs[i].p_filesz - 1, &probe, 1)) return -1;
+
+        if (phdrs[i].p_vaddr < start) start = phdrs[i].p_vaddr;
+        if (phdrs[i].p_vaddr + phdrs[i].p_memsz > end) end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+
+        elf_segment_t *seg = &image->segments[image->num_segments++];
+        seg->vaddr = phdrs[i].p_vaddr;
+        seg->memsz = phdrs[i].p_memsz;
+        seg->offset = phdrs[i].p_offset;
+        seg->filesz = phdrs[i].p_filesz;
+        seg->flags = phdrs[i].p_flags;
+    }
+    if (start >= end) return -1;
+    if (!_elf_fits(ehdr.e_entry, 1, load_start, load_end)) return -1;
+
+    image->entry = ehdr.e_entry;
+    image->special_mode = ehdr.e_ident[0];
+    image->start = PAGE_ALIGN(start);
+    image->end = PAGE_ALIGN((end + PAGE_SIZE - 1));
+    return 0;
+}
+
+void elf_fill_page(xentry *file, elf_image_t *image, uint32_t page, uint8_t *dest) {
+    memsetl(dest, 0, PAGE_SIZE / sizeof(uint32_t));
+    if (!file || !image) return;
+
+    // Copy the file backed part of every segment that overlaps this page (the rest is .bss or a gap):
+    uint32_t i;
+    for (i = 0; i < image->num_segments; i++) {
+        elf_segment_t *seg = &image->segments[i];
+        uint32_t from = (seg->vaddr > page) ? seg->vaddr : page;
+        uint32_t to = seg->vaddr + seg->filesz;
+        if (to > page + PAGE_SIZE) to = page + PAGE_SIZE;
+        if (from >= to) continue;
+
+        filesys_read_bytes(file, seg->offset + (from - seg->vaddr), (int8_t *)dest + (from - page), to - from);
+    }
+}
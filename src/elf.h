@@ -0,0 +1,112 @@
+#ifndef ELF_H
+#define ELF_H
+#include "types.h"
+#include "filesystem.h"
+
+// ELF32 executable loader
+// Only PT_LOAD segments matter. Nothing is loaded up front: elf_parse checks the headers and
+// remembers the segments, then each page is filled in on its first touch (elf_fill_page, see vma.c).
+// Everything past p_filesz up to p_memsz (.bss) is zero, and so are the gaps between segments.
+
+// e_ident layout:
+#define EI_NIDENT ((16))
+#define EI_CLASS ((4))
+#define EI_DATA ((5))
+#define ELFCLASS32 ((1))
+#define ELFDATA2LSB ((1))
+
+#define ET_EXEC ((2))
+#define EM_386 ((3))
+
+// Segment types (we only care about one of them):
+#define PT_LOAD ((1))
+
+// Most program headers we will look at (gcc emits ~10 for a static binary)
+#define ELF_MAX_PHDRS ((16))
+
+// Segment permissions:
+#define PF_X ((0x1))
+#define PF_W ((0x2))
+#define PF_R ((0x4))
+
+typedef struct Elf32_Ehdr {
+    uint8_t e_ident[EI_NIDENT];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} Elf32_Ehdr;
+
+typedef struct Elf32_Phdr {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} Elf32_Phdr;
+
+// A PT_LOAD segment
+typedef struct elf_segment_t {
+    uint32_t vaddr;
+    uint32_t memsz;
+    uint32_t offset;
+    uint32_t filesz;
+    uint32_t flags; // PF_*
+} elf_segment_t;
+
+// What the process loader needs to know about an image
+typedef struct elf_image_t {
+    // Where to start executing:
+    uint32_t entry;
+
+    // First byte of the ELF magic (0x7F normally, else the set UID config, see _process_create_user)
+    uint8_t special_mode;
+
+    // Pages the image covers, [start, end), both page aligned:
+    uint32_t start;
+    uint32_t end;
+
+    // Loadable segments, in program header order:
+    uint32_t num_segments;
+    elf_segment_t segments[ELF_MAX_PHDRS];
+} elf_image_t;
+
+/*
+ * elf_check_header
+ *
+ * Is this the header of a 32 bit x86 executable we can load?
+ * The first byte of the magic is ignored, make_fs.py uses it for the set UID config.
+ */
+bool elf_check_header(Elf32_Ehdr *ehdr);
+
+/*
+ * elf_parse
+ *
+ * Read the headers of file and fill in image. Every segment has to land in
+ * [load_start, load_end), and the entrypoint too.
+ *
+ * Returns 0 on success, -1 if this isn't a loadable ELF.
+ */
+int32_t elf_parse(xentry *file, uint32_t load_start, uint32_t load_end, elf_image_t *image);
+
+/*
+ * elf_fill_page
+ *
+ * Write what belongs in the page at virtual address page (page aligned) into dest (4kb):
+ * whatever parts of the segments of image fall in it, zeroes everywhere else.
+ */
+void elf_fill_page(xentry *file, elf_image_t *image, uint32_t page, uint8_t *dest);
+
+#endif
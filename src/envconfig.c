@@ -1,5 +1,9 @@
 #include "envconfig.h"
 #include "typeable.h"
+#include "process.h"
+#include "user.h"
+#include "pit.h"
+#include "scheduler.h"
 
 // Array of system configurations:
 env_var env_vars[NUM_ENV_VARS];
@@ -15,6 +19,20 @@ size_t sys_envconfig(uint32_t option_code, uint32_t option_value) {
         if (option_code == ENV_CONFIG_CLEAR_SCREEN) {
             current_typeable_clear();
         }
+        else if (option_code == ENV_CONFIG_TICK_RATE || option_code == ENV_CONFIG_TIME_SLICE) {
+            // Scheduler knobs affect everyone, only superuser can touch them
+            if (current_proc != NULL && !access_ok(current_proc->uid, &system_resource)) {
+                return -1;
+            }
+
+            if (option_code == ENV_CONFIG_TICK_RATE) {
+                env_vars[option_code].value = pit_set_frequency(option_value);
+            }
+            else {
+                scheduler_set_quantum(option_value);
+                env_vars[option_code].value = scheduler_get_quantum();
+            }
+        }
         else {
             env_vars[option_code].value = option_value;
         }
@@ -9,7 +9,18 @@
 // Print characters as '*'s?
 // 0 = no, anything else = yes
 
-#define NUM_ENV_VARS ((2))
+// OPTION 1: CLEAR_SCREEN
+// Clears the current typeable (value is ignored)
+
+// OPTION 2: TICK_RATE
+// Scheduler tick (PIT) frequency in Hz, clamped to PIT_MIN_HZ..PIT_MAX_HZ
+// Superuser only
+
+// OPTION 3: TIME_SLICE
+// Length of a scheduler time slice in ms
+// Superuser only
+
+#define NUM_ENV_VARS ((4))
 
 typedef struct env_var {
     uint32_t value;
@@ -23,5 +34,7 @@ extern env_var env_vars[NUM_ENV_VARS];
 #define ENV_CONFIG_HIDE_CHARS() ((env_vars[ENV_CONFIG_HIDE_CHARS_IDX].value))
 
 #define ENV_CONFIG_CLEAR_SCREEN ((1))
+#define ENV_CONFIG_TICK_RATE ((2))
+#define ENV_CONFIG_TIME_SLICE ((3))
 
 #endif
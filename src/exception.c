@@ -10,6 +10,7 @@
 #include "gui.h"
 #include "interrupt.h"
 #include "keymap.h"
+#include "clock.h"
 
 // Instead of panicing, just kill the crashing process
 // iretctx should point to iret context that was pushed to this stack
@@ -173,11 +174,35 @@ void crash_reason_error_code(char *reason, char *error_code_name, uint32_t error
  * This is called whenever a page fault occurs.
  *
  * bad_addr is copied from CR2 and placed on the stack for us by page_fault_entry.
- * Implicitly, there is also an iret context and error code placed on the stack by the exception entry.
- * page_fault_entry doesn't do copy it or anything- the variable "iretctx" is the real iret context!
+ * iretctx points at the real iret context (right above the error code the CPU pushed).
+ *
+ * If the address is somewhere the current user process is allowed to touch, but that isn't
+ * backed yet, the page gets filled in and we return to retry the access. This goes for the
+ * kernel touching user memory during a syscall too.
+ * Anything else in user memory kills the process, whether it or the kernel (on its behalf) made the access.
  */
-void page_fault_handler(uint32_t bad_addr, uint32_t error_code, iret_context iretctx) {
-    _sysret_if_user(&iretctx, "Segmentation Fault\n", bad_addr);
+void page_fault_handler(uint32_t bad_addr, uint32_t error_code, iret_context *iretctx) {
+    if (current_proc && !current_proc->kern_proc && as_is_current(&current_proc->as)) {
+        uint64_t start_ns = clock_ns();
+        int32_t result = vma_fault(&current_proc->as, current_proc->vmas, bad_addr, error_code);
+        if (result != VMA_FAULT_BAD) {
+            if (result == VMA_FAULT_FILE) current_proc->faults_file++;
+            else if (result == VMA_FAULT_SHARED) current_proc->faults_shared++;
+            else if (result == VMA_FAULT_COW) current_proc->faults_cow++;
+            else current_proc->faults_zero++;
+            current_proc->fault_ns += clock_ns() - start_ns;
+            return;
+        }
+    }
+
+    _sysret_if_user(iretctx, "Segmentation Fault\n", bad_addr);
+
+    // The kernel tripped over a bad user buffer during a syscall (one that runs off the end of its mapping,
+    // or into something read only). That's on the process, so kill it instead of panicking
+    if (current_proc && !current_proc->kern_proc && is_user_addr(bad_addr)) {
+        current_typeable_printf("Segmentation Fault\n");
+        sysret(bad_addr);
+    }
 
     if (!vga_use_highres_gui) {
         vga_popup_clear();
@@ -0,0 +1,190 @@
+#include "exec_cache.h"
+#include "util.h"
+#include "paging.h"
+#include "pmm.h"
+#include "kmalloc.h"
+
+// Every image we have, in use or not:
+static exec_image_t *exec_images = NULL;
+static uint32_t exec_cache_clock = 0;
+
+// Stats:
+static uint32_t exec_cache_hits = 0;
+static uint32_t exec_cache_misses = 0;
+static uint32_t exec_cache_evictions = 0;
+static uint32_t exec_cache_reclaims = 0;
+static uint32_t exec_cache_shared_pages = 0;
+
+// Give back everything an image owns (no one can be using it)
+static void _exec_image_free(exec_image_t *exe) {
+    uint32_t i;
+    for (i = 0; i < exe->num_frames; i++) {
+        if (exe->frames[i]) {
+            pmm_free((void *)exe->frames[i], 0);
+            exec_cache_shared_pages--;
+        }
+    }
+    kfree(exe->frames);
+    kfree(exe);
+}
+
+// Evict the least recently used image no one is running, if there are more than keep of them
+// Returns whether one was evicted
+static bool _exec_cache_evict_lru(uint32_t keep) {
+    uint32_t flags = cli_and_save();
+    exec_image_t **lru = NULL;
+    exec_image_t **link;
+    uint32_t unused = 0;
+    for (link = &exec_images; *link; link = &(*link)->next) {
+        if ((*link)->refs) continue;
+        unused++;
+        if (!lru || (*link)->last_used < (*lru)->last_used) lru = link;
+    }
+
+    if (unused <= keep) {
+        restore_flags(flags);
+        return false;
+    }
+
+    exec_image_t *victim = *lru;
+    *lru = victim->next;
+    exec_cache_evictions++;
+    _exec_image_free(victim);
+    restore_flags(flags);
+    return true;
+}
+
+// Evict least recently used images no one is running until there are at most EXEC_CACHE_ENTRIES of them
+static void _exec_cache_trim() {
+    while (_exec_cache_evict_lru(EXEC_CACHE_ENTRIES));
+}
+
+bool exec_cache_reclaim() {
+    if (!_exec_cache_evict_lru(0)) return false;
+    exec_cache_reclaims++;
+    return true;
+}
+
+exec_image_t *exec_image_get(xentry *file, uint32_t load_start, uint32_t load_end) {
+    if (!file) return NULL;
+    uint32_t flags = cli_and_save();
+    exec_image_t *exe;
+
+    for (exe = exec_images; exe; exe = exe->next) {
+        if (exe->file == file) {
+            exe->refs++;
+            exe->last_used = ++exec_cache_clock;
+            exec_cache_hits++;
+            restore_flags(flags);
+            return exe;
+        }
+    }
+    exec_cache_misses++;
+    restore_flags(flags);
+
+    // Not cached, read its headers:
+    exe = kmalloc(sizeof(exec_image_t));
+    if (!exe) return NULL;
+    if (0 != elf_parse(file, load_start, load_end, &exe->image)) {
+        kfree(exe);
+        return NULL;
+    }
+
+    exe->num_frames = (exe->image.end - exe->image.start) / PAGE_SIZE;
+    exe->frames = kmalloc(exe->num_frames * sizeof(uint32_t));
+    if (!exe->frames) {
+        kfree(exe);
+        return NULL;
+    }
+    memsetl(exe->frames, 0, exe->num_frames);
+    exe->file = file;
+    exe->refs = 1;
+
+    flags = cli_and_save();
+    exe->last_used = ++exec_cache_clock;
+    exe->next = exec_images;
+    exec_images = exe;
+    restore_flags(flags);
+
+    _exec_cache_trim();
+    return exe;
+}
+
+void exec_image_hold(exec_image_t *exe) {
+    if (!exe) return;
+    uint32_t flags = cli_and_save();
+    exe->refs++;
+    restore_flags(flags);
+}
+
+void exec_image_put(exec_image_t *exe) {
+    if (!exe) return;
+    uint32_t flags = cli_and_save();
+    if (exe->refs) exe->refs--;
+    exe->last_used = ++exec_cache_clock;
+    restore_flags(flags);
+
+    _exec_cache_trim();
+}
+
+uint32_t exec_image_resident_page(exec_image_t *exe, uint32_t page) {
+    if (!exe || page < exe->image.start || page >= exe->image.end) return 0;
+    return exe->frames[(page - exe->image.start) / PAGE_SIZE];
+}
+
+uint32_t exec_image_shared_page(exec_image_t *exe, uint32_t page, bool *new) {
+    if (new) *new = false;
+    if (!exe || page < exe->image.start || page >= exe->image.end) return 0;
+    uint32_t idx = (page - exe->image.start) / PAGE_SIZE;
+    if (exe->frames[idx]) return exe->frames[idx];
+
+    void *phys = pmm_alloc(0);
+    if (!phys) return 0;
+
+    // Interrupts stay off until it's in the table, so two processes can't both read the same page in
+    uint32_t flags = cli_and_save();
+    if (exe->frames[idx]) {
+        pmm_free(phys, 0);
+    }
+    else {
+        elf_fill_page(exe->file, &exe->image, page, scratch_map_page(SCRATCH_SLOT_FILL, (uint32_t)phys));
+        exe->frames[idx] = (uint32_t)phys;
+        exec_cache_shared_pages++;
+        if (new) *new = true;
+    }
+    uint32_t shared = exe->frames[idx];
+    restore_flags(flags);
+    return shared;
+}
+
+size_t exec_cache_report(char *buf, size_t size) {
+    size_t bytes_read = 0;
+    uint32_t cached = 0, running = 0;
+    exec_image_t *exe;
+    char linebuf[128];
+
+    uint32_t flags = cli_and_save();
+    for (exe = exec_images; exe; exe = exe->next) {
+        cached++;
+        if (exe->refs) running++;
+    }
+    snprintf(linebuf, sizeof(linebuf), "hits: %u\nmisses: %u\nevictions: %u (%u for memory)\ncached: %u (%u running)\nshared pages: %u\n",
+        exec_cache_hits, exec_cache_misses, exec_cache_evictions, exec_cache_reclaims, cached, running, exec_cache_shared_pages);
+    bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+
+    // One line per binary: [NAME] [PROCESSES] [SHARED PAGES]
+    for (exe = exec_images; exe; exe = exe->next) {
+        char name[FS_NAME_LEN + 1];
+        uint32_t i, pages = 0;
+        for (i = 0; i < exe->num_frames; i++) {
+            if (exe->frames[i]) pages++;
+        }
+        memcpy(name, exe->file->name, FS_NAME_LEN);
+        name[FS_NAME_LEN] = '\0';
+
+        snprintf(linebuf, sizeof(linebuf), "%s: %u %u\n", name, exe->refs, pages);
+        bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+    }
+    restore_flags(flags);
+    return bytes_read;
+}
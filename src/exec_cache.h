@@ -0,0 +1,78 @@
+#ifndef EXEC_CACHE_H
+#define EXEC_CACHE_H
+#include "types.h"
+#include "filesystem.h"
+#include "elf.h"
+
+// Exec image cache
+// One exec_image_t per binary that is running (or ran recently), keyed by its fentry.
+// It holds the parsed layout (entrypoint and segments, see elf_parse) and the physical pages of the
+// read only segments. Every process running the binary maps those same pages instead of its own copy,
+// only writeable segments are private (and filled in from the file on demand, see vma.c).
+// Images stay while any process holds a reference. Unused ones are kept around (pages and all) so
+// running them again is free, until the pmm runs out of memory and takes them back (exec_cache_reclaim),
+// least recently used first. EXEC_CACHE_ENTRIES caps how many unused ones there can be regardless.
+
+// Max unused binaries to keep around:
+#define EXEC_CACHE_ENTRIES ((4))
+
+typedef struct exec_image_t {
+    // Binary this is (never NULL):
+    xentry *file;
+
+    // Its layout:
+    elf_image_t image;
+
+    // Processes using it:
+    uint32_t refs;
+
+    // Physical page behind each page of [image.start, image.end) that's read in yet (0 if not)
+    // Only pages of read only segments are ever in here
+    uint32_t *frames;
+    uint32_t num_frames;
+
+    // exec_cache_clock value the last time this was used:
+    uint32_t last_used;
+
+    struct exec_image_t *next;
+} exec_image_t;
+
+/*
+ * exec_image_get
+ *
+ * Get the image of file, parsing it (to be loaded in [load_start, load_end)) if it isn't cached.
+ * The caller owns a reference, give it back with exec_image_put.
+ * Returns NULL if file isn't a valid ELF (or we ran out of memory).
+ */
+exec_image_t *exec_image_get(xentry *file, uint32_t load_start, uint32_t load_end);
+
+// Take another reference to an image you already hold one to (fork)
+void exec_image_hold(exec_image_t *exe);
+
+// Drop a reference from exec_image_get/ exec_image_hold
+void exec_image_put(exec_image_t *exe);
+
+/*
+ * exec_image_shared_page
+ *
+ * Physical page shared by everyone for page (page aligned) of a read only segment of exe.
+ * Reads it in from the file if no one has touched it yet (new is set when that happened).
+ * Returns 0 if we ran out of memory. The page belongs to exe, don't free it.
+ */
+uint32_t exec_image_shared_page(exec_image_t *exe, uint32_t page, bool *new);
+
+// Physical page for page if it's already read in (0 if it isn't)
+uint32_t exec_image_resident_page(exec_image_t *exe, uint32_t page);
+
+/*
+ * exec_cache_reclaim
+ *
+ * Evict the least recently used image no one is running, giving back its pages.
+ * Called by pmm_alloc when it's out of memory. Returns false if there was nothing to evict.
+ */
+bool exec_cache_reclaim(void);
+
+// Hit/ miss counters and shared pages (for /proc/exec_cache), returns bytes written
+size_t exec_cache_report(char *buf, size_t size);
+
+#endif
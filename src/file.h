@@ -119,6 +119,9 @@ typedef struct fd_t {
     // Used by the custom filesystem ("fs"):
     struct xentry *fs_xentry;
 
+    // Used by /proc: which file in it this is
+    uint32_t proc_file;
+
     // Common to all filesystems:
     size_t fs_offset;
 
@@ -4,6 +4,7 @@
 #include "vga.h"
 #include "file.h"
 #include "sandbox.h"
+#include "dcache.h"
 
 // The filesystem root:
 xentry *fs_root;
@@ -72,11 +73,78 @@ bool check_path(char *path) {
     return true;
 }
 
+uint32_t filesys_name_hash (char *name, size_t name_len) {
+    uint32_t hash = 2166136261;
+    size_t i;
+    for (i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Version 1 directory: scan every entry
+static xentry *_filesys_dir_scan (xentry *dir, char *name, size_t name_len) {
+    uint32_t i;
+    for (i = 0; i < dir->num_entries; i++) {
+        if (strncmp(name, fs_root[dir->blocks[i]].name, name_len + 1)) {
+            // Match!
+            return &fs_root[dir->blocks[i]];
+        }
+    }
+    return NULL;
+}
+
+// Version 2 directory: probe the hash index in the block after it
+static xentry *_filesys_dir_probe (xentry *dir, char *name, size_t name_len) {
+    uint16_t *index = (uint16_t *)(dir + 1);
+    uint32_t hash = filesys_name_hash(name, name_len);
+    uint32_t slot = hash & (FS_DIR_INDEX_SLOTS - 1);
+    uint32_t tag = (hash >> FS_DIR_INDEX_SLOT_BITS) & FS_DIR_INDEX_TAG_MASK;
+    uint32_t probes;
+
+    for (probes = 0; probes < FS_DIR_INDEX_SLOTS; probes++) {
+        uint16_t cur = index[slot];
+        if (!cur) return NULL;
+
+        uint32_t pos = (cur & FS_DIR_INDEX_POS_MASK) - 1;
+        if ((uint32_t)(cur >> FS_DIR_INDEX_POS_BITS) == tag && pos < dir->num_entries &&
+            strncmp(name, fs_root[dir->blocks[pos]].name, name_len + 1)) {
+            return &fs_root[dir->blocks[pos]];
+        }
+        slot = (slot + 1) & (FS_DIR_INDEX_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Find the entry called name (name_len bytes) in directory dir, NULL if there isn't one
+// Goes through the dentry cache first, and fills it in if we had to search the directory
+static xentry *_filesys_lookup_child (xentry *dir, char *name, size_t name_len) {
+    xentry_idx parent = dir - fs_root;
+    xentry_idx child;
+
+    if (dcache_lookup(parent, name, name_len, &child)) {
+        return (child == DCACHE_NEGATIVE) ? NULL : &fs_root[child];
+    }
+
+    xentry *found;
+    if (dir->magicnum == FS_DIR2_MAGIC) {
+        found = _filesys_dir_probe(dir, name, name_len);
+    }
+    else {
+        found = _filesys_dir_scan(dir, name, name_len);
+    }
+
+    dcache_insert(parent, name, name_len, found ? (xentry_idx)(found - fs_root) : DCACHE_NEGATIVE);
+    return found;
+}
+
 // Returns an xentry pointer to the fentry or dentry of this path:
 // NULL on failure
 xentry *filesys_lookup (char *path) {
     // Name we are searching for at this level of iteration:
-    char name_to_find[FS_NAME_LEN];
+    // (+1 so a name that is exactly FS_NAME_LEN long still gets its null terminator)
+    char name_to_find[FS_NAME_LEN + 1];
 
     // Current xentry being explored:
     xentry *current = fs_root;
@@ -106,12 +174,9 @@ xentry *filesys_lookup (char *path) {
 
     // Check current substring for a match:
     while(1) {
-        uint32_t i = 0;
-
         // If this isn't a directory entry, bail
-        if (current->magicnum != FS_DIR_MAGIC) { return NULL; }
+        if (!filesys_is_dir(current)) { return NULL; }
         
-        bool child_found = false;
         path_remaining = split(path_remaining, name_to_find, '/', sizeof(name_to_find));
         size_t name_to_find_len = strlen(name_to_find) + 1; // Add 1 for null terminator
 
@@ -129,26 +194,18 @@ xentry *filesys_lookup (char *path) {
                 return NULL;
         }
 
-        // Scan entries at the current directory block
-        for (i = 0; i < current->num_entries; i++) {
-            if (strncmp(name_to_find, fs_root[current->blocks[i]].name, name_to_find_len)) {
-                // Match!
-                child_found = true;
-                if (*path_remaining == '\0') {
-                    // No more slashes, this is the file we have been looking for
-                    return &fs_root[current->blocks[i]];
-                }
-                else {
-                    // Explore this directory:
-                    current = &fs_root[current->blocks[i]];
-                }
-                break;
-            }
-        }
-        if (!child_found) {
+        xentry *child = _filesys_lookup_child(current, name_to_find, name_to_find_len - 1);
+        if (!child) {
             // name_to_find not in this directory
             return NULL;
         }
+        if (*path_remaining == '\0') {
+            // No more slashes, this is the file we have been looking for
+            return child;
+        }
+
+        // Explore this directory:
+        current = child;
     }
 
     // Couldn't find this file:
@@ -220,6 +277,36 @@ size_t filesys_read_bytes_fentry (xentry *entry, size_t offset, int8_t *buf, siz
     return bytes_read;
 }
 
+// Extent fentries: copy each extent the read covers in one go
+// Reads stop at file_size (normally entry->size)
+static size_t _filesys_read_bytes_extents (fentry_ext_t *entry, size_t offset, int8_t *buf, size_t bytes_to_read, size_t file_size) {
+    size_t bytes_read = 0;
+    size_t extent_offset = 0; // Offset into the file of the current extent
+    uint32_t i;
+
+    if (!entry) return 0;
+    if (offset >= file_size) return 0;
+    if (bytes_to_read > file_size - offset) bytes_to_read = file_size - offset;
+
+    for (i = 0; i < entry->num_entries && i < FS_MAX_EXTENTS_IN_FENTRY && bytes_read < bytes_to_read; i++) {
+        size_t extent_bytes = entry->extents[i].len * FS_BLOCK_SIZE;
+        size_t cur_offset = offset + bytes_read;
+
+        if (cur_offset < extent_offset + extent_bytes) {
+            size_t offset_into_extent = cur_offset - extent_offset;
+            size_t bytes_to_copy = bytes_to_read - bytes_read;
+            if (bytes_to_copy > extent_bytes - offset_into_extent)
+                bytes_to_copy = extent_bytes - offset_into_extent;
+
+            memcpy(buf + bytes_read, (int8_t *)&fs_root[entry->extents[i].start] + offset_into_extent, bytes_to_copy);
+            bytes_read += bytes_to_copy;
+        }
+        extent_offset += extent_bytes;
+    }
+
+    return bytes_read;
+}
+
 size_t _filesys_read_bytes_fentry_freaky (xentry *entry, size_t offset, size_t freaky_offset, int8_t *buf, size_t bytes_to_read) {
     size_t bytes_read = 0;
     size_t offset_into_block = 0;
@@ -228,6 +315,14 @@ size_t _filesys_read_bytes_fentry_freaky (xentry *entry, size_t offset, size_t f
 
     if (!entry) return 0;
 
+    if (entry->magicnum == FS_EXT_MAGIC) {
+        // Same deal, just the first FREAKY_FILE_LEN + freaky_offset bytes are readable
+        size_t readable = FREAKY_FILE_LEN + freaky_offset;
+        fentry_ext_t *ext = (fentry_ext_t *)entry;
+        if (readable > ext->size) readable = ext->size;
+        return _filesys_read_bytes_extents(ext, offset + freaky_offset, buf, bytes_to_read, readable);
+    }
+
     bool done = false;
     offset += freaky_offset;
     offset_into_block = offset % FS_DATA_BLOCK_SIZE; // Setup initial offset into block
@@ -285,7 +380,7 @@ size_t filesys_read_bytes_dentry(xentry *entry, size_t offset, int8_t *buf, size
         cur_block = filesys_lookup_idx(entry->blocks[block_idx]);
         if (!cur_block) return bytes_read;
 
-        if (cur_block->magicnum == FS_DIR_MAGIC || cur_block->magicnum == FS_DAT_MAGIC) {
+        if (filesys_is_dir(cur_block) || filesys_is_file(cur_block)) {
             strncpy(cur_block_name, cur_block->name, FS_NAME_LEN);
             size_t cur_block_name_len = strlen(cur_block_name);
 
@@ -316,8 +411,12 @@ size_t filesys_read_bytes_dentry(xentry *entry, size_t offset, int8_t *buf, size
 size_t filesys_read_bytes(xentry *entry, size_t offset, int8_t *buf, size_t bytes_to_read) {
     if (!entry) return 0;
 
-    if (entry->magicnum == FS_DIR_MAGIC) return filesys_read_bytes_dentry(entry, offset, buf, bytes_to_read);
+    if (filesys_is_dir(entry)) return filesys_read_bytes_dentry(entry, offset, buf, bytes_to_read);
     if (entry->magicnum == FS_DAT_MAGIC) return filesys_read_bytes_fentry(entry, offset, buf, bytes_to_read);
+    if (entry->magicnum == FS_EXT_MAGIC) {
+        fentry_ext_t *ext = (fentry_ext_t *)entry;
+        return _filesys_read_bytes_extents(ext, offset, buf, bytes_to_read, ext->size);
+    }
 
     return 0;
 }
@@ -28,6 +28,26 @@
 #define FS_DIR_MAGIC ((0xdeadd150))
 #define FS_DAT_MAGIC ((0xdeadda7a))
 
+// Extent fentries:
+// Instead of one index per data block, the file is a list of extents (runs of consecutive blocks),
+// its size is in the fentry and the data blocks have no size header. Consecutive blocks are next to
+// each other in memory, so reading across a whole extent is a single memcpy.
+#define FS_EXT_MAGIC ((0xdeadda7e))
+
+// Version 2 directory blocks:
+// Same layout as a version 1 directory block but entries are sorted by name, and the block
+// right after it (index + 1) is a hash index of the entries so lookups don't scan the directory.
+// The hash index is FS_DIR_INDEX_SLOTS 16 bit slots, a name goes in slot filesys_name_hash(name) % FS_DIR_INDEX_SLOTS
+// (or the next free one after it). Each slot is (tag << FS_DIR_INDEX_POS_BITS) | (position in the directory + 1),
+// where tag is the next few bits of the hash so most wrong slots can be skipped without comparing names.
+// A slot of 0 is empty.
+#define FS_DIR2_MAGIC ((0xdeadd152))
+#define FS_DIR_INDEX_SLOTS ((FS_BLOCK_SIZE / 2))
+#define FS_DIR_INDEX_SLOT_BITS ((11))
+#define FS_DIR_INDEX_POS_BITS ((10))
+#define FS_DIR_INDEX_POS_MASK (((1 << FS_DIR_INDEX_POS_BITS) - 1))
+#define FS_DIR_INDEX_TAG_MASK (((1 << (16 - FS_DIR_INDEX_POS_BITS)) - 1))
+
 // Just to make distinguishing int vs index a bit easier:
 typedef uint32_t xentry_idx;
 
@@ -46,6 +66,29 @@ typedef struct fentry_block_struct_t {
     xentry_idx blocks[FS_MAX_DATA_BLOCKS_IN_FENTRY];
 } fentry_t;
 
+// One run of data blocks in an extent fentry:
+typedef struct fs_extent_struct_t {
+    // First block:
+    xentry_idx start;
+
+    // Number of blocks:
+    uint32_t len;
+} fs_extent_t;
+
+#define FS_MAX_EXTENTS_IN_FENTRY ((FS_BLOCK_SIZE - FS_FENTRY_HEADER_LEN - 4)/sizeof(fs_extent_t))
+
+// An extent fentry (num_entries is the number of extents):
+typedef struct fentry_ext_block_struct_t {
+    uint32_t magicnum;
+    uint32_t num_entries;
+    char name[FS_NAME_LEN];
+
+    // File size in bytes:
+    uint32_t size;
+
+    fs_extent_t extents[FS_MAX_EXTENTS_IN_FENTRY];
+} fentry_ext_t;
+
 // A directory block:
 typedef struct dir_block_struct_t {
     uint32_t magicnum;
@@ -90,6 +133,19 @@ xentry *filesys_lookup (char *path);
 // NULL on failure
 xentry *filesys_lookup_idx (xentry_idx idx);
 
+// Is this a directory block (either version)?
+static inline bool filesys_is_dir (xentry *entry) {
+    return entry->magicnum == FS_DIR_MAGIC || entry->magicnum == FS_DIR2_MAGIC;
+}
+
+// Is this a fentry (either kind)?
+static inline bool filesys_is_file (xentry *entry) {
+    return entry->magicnum == FS_DAT_MAGIC || entry->magicnum == FS_EXT_MAGIC;
+}
+
+// Hash of a name (name_len bytes) used by version 2 directory hash indices (FNV-1a, make_fs.py has to match)
+uint32_t filesys_name_hash (char *name, size_t name_len);
+
 // Methods for reading and writing files
 // If this is a directory, reading from it will return a list of file names
 // If this is a file, reading from it will return data
@@ -0,0 +1,180 @@
+#include "fpu.h"
+#include "process.h"
+#include "util.h"
+
+// CPUID leaf 1 EDX feature bits:
+#define CPUID_FPU ((1 << 0))
+#define CPUID_FXSR ((1 << 24))
+#define CPUID_SSE ((1 << 25))
+
+// Control register bits:
+#define CR0_MP ((1 << 1))
+#define CR0_EM ((1 << 2))
+#define CR0_TS ((1 << 3))
+#define CR0_NE ((1 << 5))
+#define CR4_OSFXSR ((1 << 9))
+#define CR4_OSXMMEXCPT ((1 << 10))
+
+// Default MXCSR: all SSE exceptions masked, round to nearest
+#define MXCSR_DEFAULT ((0x1F80))
+
+static bool has_fpu = false;
+static bool sse_enabled = false;
+
+// Process whose state is in the FPU registers right now (NULL if nobody's):
+static pcb_t *fpu_owner = NULL;
+
+// Is CR0.TS set? (Saves writing CR0 on every switch when it already is)
+static bool ts_set = false;
+
+// What a process sees the first time it uses the FPU:
+static uint8_t fpu_clean_state[FPU_STATE_SIZE] __attribute__((aligned(16)));
+
+uint32_t fpu_num_traps = 0;
+uint32_t fpu_num_saves = 0;
+
+static inline void _set_ts() {
+    asm volatile (
+        "movl %%cr0, %%eax\n" \
+        "orl %0, %%eax\n" \
+        "movl %%eax, %%cr0" : : "i"(CR0_TS) : "eax"
+    );
+    ts_set = true;
+}
+
+static inline void _clear_ts() {
+    asm volatile ("clts");
+    ts_set = false;
+}
+
+// Without FXSR we can still lazily switch the x87 state, it's just smaller (108 bytes)
+static inline void _fpu_save(uint8_t *area) {
+    if (sse_enabled) {
+        asm volatile ("fxsave (%0)" : : "r"(area) : "memory");
+    }
+    else {
+        asm volatile ("fnsave (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static inline void _fpu_restore(uint8_t *area) {
+    if (sse_enabled) {
+        asm volatile ("fxrstor (%0)" : : "r"(area) : "memory");
+    }
+    else {
+        asm volatile ("frstor (%0)" : : "r"(area) : "memory");
+    }
+}
+
+void init_fpu() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    has_fpu = (edx & CPUID_FPU) != 0;
+    if (!has_fpu) return;
+
+    // FPU instructions run natively (no EM), WAIT/FWAIT honors TS (MP), and x87 errors
+    // are reported as #MF instead of through the PIC (NE)
+    asm volatile (
+        "movl %%cr0, %%eax\n" \
+        "andl %0, %%eax\n" \
+        "orl %1, %%eax\n" \
+        "movl %%eax, %%cr0" : : "i"(~(CR0_EM | CR0_TS)), "i"(CR0_MP | CR0_NE) : "eax"
+    );
+    ts_set = false;
+
+    // Tell the CPU we FXSAVE/ FXRSTOR the SSE state and can handle SIMD exceptions
+    if ((edx & CPUID_FXSR) && (edx & CPUID_SSE)) {
+        asm volatile (
+            "movl %%cr4, %%eax\n" \
+            "orl %0, %%eax\n" \
+            "movl %%eax, %%cr4" : : "i"(CR4_OSFXSR | CR4_OSXMMEXCPT) : "eax"
+        );
+        sse_enabled = true;
+    }
+
+    // Snapshot a freshly reset FPU for new processes:
+    asm volatile ("fninit");
+    if (sse_enabled) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        asm volatile ("ldmxcsr %0" : : "m"(mxcsr));
+    }
+    _fpu_save(fpu_clean_state);
+
+    fpu_owner = NULL;
+}
+
+bool fpu_sse_enabled() {
+    return sse_enabled;
+}
+
+void fpu_init_process(pcb_t *process) {
+    if (!process) return;
+    process->fpu_used = false;
+}
+
+void fpu_switch(pcb_t *process) {
+    if (!has_fpu) return;
+
+    if (process != NULL && process == fpu_owner) {
+        // Our registers are still loaded, no need to trap
+        if (ts_set) _clear_ts();
+    }
+    else if (!ts_set) {
+        _set_ts();
+    }
+}
+
+void fpu_release(pcb_t *process) {
+    if (fpu_owner == process) {
+        fpu_owner = NULL;
+    }
+}
+
+void fpu_fork(pcb_t *parent, pcb_t *child) {
+    if (!parent || !child) return;
+    uint32_t flags = cli_and_save();
+
+    child->fpu_used = parent->fpu_used;
+    if (has_fpu && parent == fpu_owner) {
+        // The parent's registers are live, save them straight into the child
+        bool was_set = ts_set;
+        if (was_set) _clear_ts();
+        _fpu_save(child->fpu_state);
+
+        // FNSAVE resets the FPU, so the parent needs its registers back
+        if (!sse_enabled) _fpu_restore(child->fpu_state);
+        if (was_set) _set_ts();
+        child->fpu_used = true;
+    }
+    else if (parent->fpu_used) {
+        memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+    }
+
+    restore_flags(flags);
+}
+
+// Someone touched the FPU while CR0.TS was set
+// Move the registers over to them
+void fpu_nm_handler() {
+    _clear_ts();
+    if (fpu_owner == current_proc) return;
+
+    fpu_num_traps++;
+    if (NULL != fpu_owner) {
+        _fpu_save(fpu_owner->fpu_state);
+        fpu_num_saves++;
+    }
+
+    if (NULL != current_proc && current_proc->fpu_used) {
+        _fpu_restore(current_proc->fpu_state);
+    }
+    else {
+        _fpu_restore(fpu_clean_state);
+    }
+
+    if (NULL != current_proc) {
+        current_proc->fpu_used = true;
+    }
+    fpu_owner = current_proc;
+}
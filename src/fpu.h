@@ -0,0 +1,44 @@
+#ifndef FPU_H
+#define FPU_H
+#include "types.h"
+
+struct pcb_t;
+
+// x87/ SSE state
+// The FPU is handed out lazily: switching processes just sets CR0.TS, and the first
+// FPU/ SSE instruction after that traps (#NM). Only then do we FXSAVE whoever owned the
+// registers and FXRSTOR the new process. Processes that never touch the FPU never pay for it.
+
+// Size of an FXSAVE area:
+#define FPU_STATE_SIZE ((512))
+
+// Device not available exception:
+#define DEV_NOT_AVAIL 7
+
+// Enable SSE (if supported) and setup lazy switching
+void init_fpu(void);
+
+// Is SSE enabled?
+bool fpu_sse_enabled(void);
+
+// Reset a new process's FPU state (it gets a clean one on first use)
+void fpu_init_process(struct pcb_t *process);
+
+// Called on every switch to process, arms the #NM trap if it doesn't own the FPU
+void fpu_switch(struct pcb_t *process);
+
+// Called when a process dies, so we don't save state into a dead PCB
+void fpu_release(struct pcb_t *process);
+
+// Give child a copy of parent's FPU state (fork)
+void fpu_fork(struct pcb_t *parent, struct pcb_t *child);
+
+// #NM handler
+void fpu_nm_handler(void);
+extern void fpu_nm_entry(void);
+
+// Counters (for benchmarks and such):
+extern uint32_t fpu_num_traps;
+extern uint32_t fpu_num_saves;
+
+#endif
@@ -7,6 +7,7 @@
 #include "syscall.h"
 #include "scheduler.h"
 #include "rtc.h"
+#include "fpu.h"
 
 idt_entry_t idt[IDT_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 
@@ -29,6 +30,7 @@ void initialize_interrupts(void) {
     init_irq_kern(GEN_PROTECT_FAULT, gen_protect_fault_entry);
     init_irq_kern(PAGE_FAULT, page_fault_entry);
     init_irq_kern(DBL_FAULT, double_fault_entry);
+    init_irq_kern(DEV_NOT_AVAIL, fpu_nm_entry);
 
     // Interrupts:
     init_irq_kern(INT_BASE + IRQ_PIT,       scheduler_entry);
@@ -125,6 +127,14 @@ void hw_pic_unmask(uint8_t irq_num) {
     }
 }
 
+bool hw_pic_is_masked(uint8_t irq_num) {
+    // Reading DATA gives the IMR, same as in hw_pic_mask
+    if (irq_num >= 8) {
+        return (inb(PIC2_DATA) >> (irq_num - 8)) & 0x01;
+    }
+    return (inb(PIC1_DATA) >> irq_num) & 0x01;
+}
+
 void hw_pic_mask(uint8_t irq_num) {
     // Whenver you read from DATA you get the current IMR
     // (Interrupt Mask Register)
@@ -17,6 +17,7 @@ void hw_pic_enable(void); // Enable PIC
 void hw_pic_eoi(uint8_t irq_num); // Send EOI
 void hw_pic_mask(uint8_t irq_num); // Mask vector
 void hw_pic_unmask(uint8_t irq_num); // Unmask vector
+bool hw_pic_is_masked(uint8_t irq_num); // Is vector masked?
 
 // i8259 Control Defines:
 #define PIC1_ADDR 0x20
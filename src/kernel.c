@@ -11,6 +11,8 @@
 #include "typeable.h"
 #include "textfield.h"
 #include "multiboot.h"
+#include "pmm.h"
+#include "kmalloc.h"
 #include "filesystem.h"
 #include "exception.h"
 #include "syscall.h"
@@ -25,6 +27,11 @@
 #include "procfs.h"
 #include "sandbox.h"
 #include "rtc.h"
+#include "pit.h"
+#include "timer.h"
+#include "clock.h"
+#include "fpu.h"
+#include "bench.h"
 
 // Default typeable
 typeable typeable_default = {
@@ -121,7 +128,7 @@ bool password_timing_side_channel;
 void entry (multiboot_t *boot_info) {
     configure_segments();
 
-    videomem = (color *)boot_info->framebuffer_addr;
+    videomem = (color *)(uint32_t)boot_info->framebuffer_addr;
 
     vga_use_highres_gui = false;
     vga_clear();
@@ -130,8 +137,14 @@ void entry (multiboot_t *boot_info) {
 
     fs_root = (xentry *)boot_info->mods_addr[0];
 
+    // Find out what physical memory we have (before paging, while the multiboot info is reachable):
+    init_pmm(boot_info);
+
     enable_paging();
 
+    // Size class caches for kmalloc:
+    init_kmalloc();
+
     // Map all filesystems:
     mount_fs("/", &root_fs_ops);
     mount_fs("/proc", &proc_fs_ops);
@@ -147,6 +160,9 @@ void entry (multiboot_t *boot_info) {
 
     initialize_interrupts();
 
+    // Enable SSE and lazy FPU switching:
+    init_fpu();
+
     // Clear the screen:
     vga_clear();
     vga_setcolor(0x0f);
@@ -158,6 +174,13 @@ void entry (multiboot_t *boot_info) {
         hw_pic_mask(i);
     }
 
+    // Program the PIT (IRQ 0 stays masked for now) and setup kernel timers:
+    init_timers();
+    init_pit();
+
+    // Calibrate the TSC against the PIT for the monotonic clock:
+    init_clock();
+
     // Enable keyboard:
     init_keyboard();
 
@@ -166,14 +189,14 @@ void entry (multiboot_t *boot_info) {
 
     // Initialize process table:
     setup_pcb_table();
+    init_scheduler();
 
     // Unmask PIT:
-    init_pit();
     hw_pic_unmask(IRQ_PIT);
 
     // Setup RTC:
+    // It stays masked- all timekeeping is done off the PIT (see timer.c)
     init_rtc();
-    hw_pic_unmask(IRQ_RTC);
     hw_pic_unmask(2);
 
 #ifdef UIUCTF
@@ -188,9 +211,9 @@ void entry (multiboot_t *boot_info) {
         // Reroute all VGA methods to use highres GUI
         vga_use_highres_gui = true;
 
-        // Map pages for GUI address:
-        map_huge_page_kern((uint32_t)videomem, (uint32_t)videomem);
-        map_huge_page_kern((uint32_t)videomem + HUGE_PAGE_SIZE, (uint32_t)videomem + HUGE_PAGE_SIZE);
+        // Map pages for GUI address (write-combining, we only ever write whole frames/ glyphs to it):
+        map_huge_page_kern_wc((uint32_t)videomem, (uint32_t)videomem);
+        map_huge_page_kern_wc((uint32_t)videomem + HUGE_PAGE_SIZE, (uint32_t)videomem + HUGE_PAGE_SIZE);
         gui_init(videomem);
 
         // Wait for user to press enter:
@@ -218,6 +241,11 @@ void entry (multiboot_t *boot_info) {
     }
     vga_cursor_enable();
 
+#if BENCHMARK_ON_BOOT
+    // Run the kernel benchmarks (results are in /proc/bench):
+    execute_kern_blocking(bench_main, 0, "bench");
+#endif
+
     // Launch the compositor/ shell manager process:
     // "launchd"
     while (1) {
@@ -368,9 +396,10 @@ void launchd () {
             current_typeable_clear();
 
             // Kill all current processes but us and the crazy caches watchdog:
-            int i;
-            for (i = NUM_KERN_PROCS; i < MAX_PROCESSES; i++) {
-                processes[i].should_die = true;
+            uint32_t pid;
+            pcb_t *p;
+            for (pid = NUM_KERN_PROCS; (p = process_next(&pid)) != NULL; pid++) {
+                sched_kill(p);
             }
         }
 #endif
@@ -383,36 +412,36 @@ void launchd () {
 // Keep watching processes for the crazy_caches process
 void crazy_caches_watchdog () {
     sti();
-    int i;
+    uint32_t pid;
+    pcb_t *p;
     while (1) {
         bool found_it = false;
-        for (i = 0; i < MAX_PROCESSES; i++) {
-            if (processes[i].in_use && strncmp(processes[i].name, "/bin/crazy_caches", FS_NAME_LEN)) {
+        for_each_process(pid, p) {
+            if (strncmp(p->name, "/bin/crazy_caches", FS_NAME_LEN)) {
                 found_it = true;
             }
         }
 
         if (!found_it) {
             // Kill all procs but us and launchd
-            int j;
-            for (j = NUM_KERN_PROCS; j < MAX_PROCESSES; j++) {
-                processes[j].should_die = true;
+            for (pid = NUM_KERN_PROCS; (p = process_next(&pid)) != NULL; pid++) {
+                sched_kill(p);
             }
         }
+
+        // Nothing changes until the next interrupt anyways
+        asm volatile ("hlt");
     }
 }
 
-// Search a huge page starting at addr
-// Maps that page to 0x16400000
-void _watchdog0_search_huge_page (void *addr) {
-    char *search_addr = (char *)0x16400000;
-    map_huge_page_kern(0x16400000, (uint32_t)addr);
-
+// Look for a "hacking number" in size bytes at search_addr
+static void _watchdog0_search(char *search_addr, uint32_t size) {
     uint32_t j = 0;
-    for (j = 0; j < HUGE_PAGE_SIZE; j++) {
+    for (j = 0; j < size; j++) {
         if (search_addr[j] == 'A') {
             uint32_t k = 0;
-            for (k = 0; k < 4; k++) {
+            // Don't look past the end, the next page probably isn't mapped
+            for (k = 0; k < 4 && j + k < size; k++) {
                 if (search_addr[j+k] != 'A') {
                     break;
                 }
@@ -426,14 +455,63 @@ void _watchdog0_search_huge_page (void *addr) {
     }
 }
 
+// Search a huge page starting at addr
+// Maps that page to 0x16400000
+void _watchdog0_search_huge_page (void *addr) {
+    map_huge_page_kern(0x16400000, (uint32_t)addr);
+    _watchdog0_search((char *)0x16400000, HUGE_PAGE_SIZE);
+}
+
+// Search a 4kb page
+// Maps that page to 0x16800000
+void _watchdog0_search_page (uint32_t phys) {
+    map_page_kern(0x16800000, phys);
+    _watchdog0_search((char *)0x16800000, PAGE_SIZE);
+}
+
+// Search every page process p (PID pid) has backed
+// Only the lookups are done with interrupts off, p could exit at any point in between
+void _watchdog0_search_process (uint32_t pid, pcb_t *p) {
+    uint32_t addr = 0;
+    while (1) {
+        uint32_t flags = cli_and_save();
+        if (pid_to_pcb(pid) != p) {
+            restore_flags(flags);
+            return;
+        }
+
+        vma_t *vma = p->vmas;
+        while (vma && vma->end <= addr) vma = vma->next;
+        if (!vma) {
+            restore_flags(flags);
+            return;
+        }
+        if (addr < vma->start) addr = vma->start;
+
+        bool huge = (vma->flags & VMA_HUGE) != 0;
+        uint32_t phys = as_virt_to_phys(&p->as, addr);
+        restore_flags(flags);
+
+        if (huge) {
+            if (phys) _watchdog0_search_huge_page((void *)phys);
+            addr += HUGE_PAGE_SIZE;
+        }
+        else {
+            if (phys) _watchdog0_search_page(phys);
+            addr += PAGE_SIZE;
+        }
+    }
+}
+
 void watchdog0() {
     sti();
     while (1) {
         // Search through user process memory and look for "hacking numbers"
-        uint32_t idx = 0;
-        for (idx = 0; idx < MAX_PROCESSES; idx++) {
-            if (processes[idx].in_use && !processes[idx].kern_proc) {
-                _watchdog0_search_huge_page(processes[idx].phys_addr);
+        uint32_t pid = 0;
+        pcb_t *p;
+        for_each_process(pid, p) {
+            if (!p->kern_proc) {
+                _watchdog0_search_process(pid, p);
             }
         }
 
@@ -447,6 +525,7 @@ void watchdog1() {
     int i = 0;
     while (1) {
         i+=2;
+        asm volatile ("hlt");
     }
 }
 
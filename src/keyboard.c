@@ -5,6 +5,8 @@
 #include "keymap.h"
 #include "typeable.h"
 #include "rtc.h"
+#include "scheduler.h"
+#include "timer.h"
 #include "system.h"
 
 #define NUM_PS2_CODES 256
@@ -67,6 +69,15 @@ static uint8_t caps_lock_state = 0;
 static bool caps_lock = false;
 static bool escape = false;
 
+// Reboot if nobody touches the keyboard for this long:
+#define TIMEOUT_MINS ((15))
+#define TIMEOUT_MS ((TIMEOUT_MINS * 60 * 1000))
+static timer_t kb_timeout_timer;
+
+static void _kb_timeout(void *data) {
+    reboot();
+}
+
 void init_keyboard(void) {
     int tmp;
 
@@ -84,6 +95,9 @@ void init_keyboard(void) {
     outb(0x64, 0x60);
     outb(0x60, tmp | 0x01 | 0x40);
     outb(0x64, 0xAE);
+
+    // Start the timeout (needs the PIT to be setup already):
+    timer_add(&kb_timeout_timer, TIMEOUT_MS, _kb_timeout, NULL);
 }
 
 void keyboard_handler(void) {
@@ -92,7 +106,8 @@ void keyboard_handler(void) {
 
     keycode = inb(0x60);
 
-    ticks_since_kb = 0;
+    // Push the timeout back:
+    timer_add(&kb_timeout_timer, TIMEOUT_MS, _kb_timeout, NULL);
     hw_pic_eoi(IRQ_KEYBOARD);
 
     if (keycode == 0x61) {
@@ -230,5 +245,8 @@ KEYBOARD_END:
     // In case any new keys came in, flush the buffer
     while (inb(0x64) & 0x01) { inb(0x60); }
 
+    // If that was enter, whoever was reading can run again
+    sched_wake_flags();
+
     restore_flags(flags);
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "kmalloc.h"
+#include "slab.h"
+#include "paging.h"
+#include "util.h"
+
+static slab_cache_t kmalloc_caches[KMALLOC_NUM_CLASSES];
+static char *kmalloc_names[KMALLOC_NUM_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+// Stats:
+static uint32_t kmalloc_num_allocs = 0;
+static uint32_t kmalloc_num_frees = 0;
+static uint32_t kmalloc_num_failed = 0;
+static uint32_t kmalloc_big_pages = 0; // Whole pages handed out
+static uint32_t kmalloc_run_pages = 0; // Pages handed out in runs of more than one
+static uint32_t kmalloc_big_huge_pages = 0; // Whole huge pages handed out
+
+#define KMALLOC_POISON_ALLOC ((0xA5A5A5A5))
+#define KMALLOC_POISON_FREE ((0x6B6B6B6B))
+
+void init_kmalloc() {
+    uint32_t i;
+    for (i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        size_t obj_size = 1 << (i + KMALLOC_MIN_SHIFT);
+        slab_cache_init_size(&kmalloc_caches[i], kmalloc_names[i], obj_size, 16, PAGE_SIZE);
+    }
+}
+
+// Size class for a request (KMALLOC_NUM_CLASSES if it's too big for any of them)
+static inline uint32_t _kmalloc_class(size_t size) {
+    if (size <= (1 << KMALLOC_MIN_SHIFT)) return 0;
+    uint32_t shift = 32 - __builtin_clz(size - 1);
+    if (shift > KMALLOC_MAX_SHIFT) return KMALLOC_NUM_CLASSES;
+    return shift - KMALLOC_MIN_SHIFT;
+}
+
+static inline void _kmalloc_poison(void *ptr, size_t size, uint32_t val) {
+#if KMALLOC_POISON
+    memsetl(ptr, val, size / sizeof(uint32_t));
+#else
+    (void)ptr;
+    (void)size;
+    (void)val;
+#endif
+}
+
+void *kmalloc(size_t size) {
+    if (0 == size || size > HUGE_PAGE_SIZE) return NULL;
+
+    void *ptr;
+    size_t real_size;
+    uint32_t class = _kmalloc_class(size);
+
+    if (class < KMALLOC_NUM_CLASSES) {
+        ptr = slab_alloc(&kmalloc_caches[class]);
+        real_size = kmalloc_caches[class].obj_size;
+    }
+    else if (size <= PAGE_SIZE) {
+        ptr = kernel_alloc_page();
+        real_size = PAGE_SIZE;
+        if (ptr) kmalloc_big_pages++;
+    }
+    else if (size <= HUGE_PAGE_SIZE - PAGE_SIZE) {
+        uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        ptr = kernel_alloc_pages(pages);
+        real_size = pages * PAGE_SIZE;
+        if (ptr) kmalloc_run_pages += pages;
+    }
+    else {
+        ptr = kernel_alloc_huge_page();
+        real_size = HUGE_PAGE_SIZE;
+        if (ptr) kmalloc_big_huge_pages++;
+    }
+
+    if (!ptr) {
+        kmalloc_num_failed++;
+        return NULL;
+    }
+
+    _kmalloc_poison(ptr, real_size, KMALLOC_POISON_ALLOC);
+    kmalloc_num_allocs++;
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) return;
+
+    if ((uint32_t)ptr & (PAGE_SIZE - 1)) {
+        slab_t *slab = (slab_t *)((uint32_t)ptr & ~(PAGE_SIZE - 1));
+        _kmalloc_poison(ptr, slab->cache->obj_size, KMALLOC_POISON_FREE);
+        slab_free(slab->cache, ptr);
+    }
+    else if (kernel_is_pages(ptr)) {
+        _kmalloc_poison(ptr, kernel_pages_len(ptr) * PAGE_SIZE, KMALLOC_POISON_FREE);
+        kmalloc_run_pages -= kernel_free_pages(ptr);
+    }
+    else if (kernel_is_huge_page(ptr)) {
+        _kmalloc_poison(ptr, HUGE_PAGE_SIZE, KMALLOC_POISON_FREE);
+        kernel_free_huge_page(ptr);
+        kmalloc_big_huge_pages--;
+    }
+    else {
+        _kmalloc_poison(ptr, PAGE_SIZE, KMALLOC_POISON_FREE);
+        kernel_free_page(ptr);
+        kmalloc_big_pages--;
+    }
+    kmalloc_num_frees++;
+}
+
+uint32_t kmalloc_bytes_in_use() {
+    uint32_t i, bytes = 0;
+    for (i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        bytes += kmalloc_caches[i].num_in_use * kmalloc_caches[i].obj_size;
+    }
+    return bytes + (kmalloc_big_pages + kmalloc_run_pages) * PAGE_SIZE + kmalloc_big_huge_pages * HUGE_PAGE_SIZE;
+}
+
+uint32_t kmalloc_bytes_reserved() {
+    uint32_t i, bytes = 0;
+    for (i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        bytes += kmalloc_caches[i].num_slabs * PAGE_SIZE;
+    }
+    return bytes + (kmalloc_big_pages + kmalloc_run_pages) * PAGE_SIZE + kmalloc_big_huge_pages * HUGE_PAGE_SIZE;
+}
+
+size_t kmalloc_report(char *buf, size_t size) {
+    size_t bytes_read = 0;
+    char linebuf[128];
+
+    snprintf(linebuf, sizeof(linebuf), "allocs: %u\nfrees: %u\nfailed: %u\nin use: %u bytes\nreserved: %u bytes\n",
+        kmalloc_num_allocs, kmalloc_num_frees, kmalloc_num_failed, kmalloc_bytes_in_use(), kmalloc_bytes_reserved());
+    bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+
+    uint32_t i;
+    for (i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        slab_cache_t *cache = &kmalloc_caches[i];
+        snprintf(linebuf, sizeof(linebuf), "%s: %u in use, %u slabs\n", cache->name, cache->num_in_use, cache->num_slabs);
+        bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+    }
+
+    snprintf(linebuf, sizeof(linebuf), "pages: %u\npages in runs: %u\nhuge pages: %u\n",
+        kmalloc_big_pages, kmalloc_run_pages, kmalloc_big_huge_pages);
+    bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+    return bytes_read;
+}
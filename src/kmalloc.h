@@ -0,0 +1,32 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+#include "types.h"
+
+// General purpose kernel allocator
+// Small requests are rounded up to a power of 2 (16 bytes up to 2kb) and come out of a slab
+// cache for that size class, every slab being one 4kb page. Anything bigger gets a whole page,
+// or however many pages in a row it needs (see kernel_alloc_pages), or a whole huge page (up to 4MB).
+// kfree doesn't need the size: slab objects are never page aligned (the slab header is at the
+// start of the page), so a page aligned pointer has to be a page, run of pages or huge page.
+
+#define KMALLOC_MIN_SHIFT ((4))
+#define KMALLOC_MAX_SHIFT ((11))
+#define KMALLOC_NUM_CLASSES ((KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1))
+
+// Setup the size class caches
+void init_kmalloc(void);
+
+// Allocate size bytes (NULL if out of memory or size is 0 or over 4MB). Contents are not cleared.
+void *kmalloc(size_t size);
+
+// Free something from kmalloc (NULL is ignored)
+void kfree(void *ptr);
+
+// Counters and per size class usage (for /proc/kmalloc), returns bytes written
+size_t kmalloc_report(char *buf, size_t size);
+
+// Bytes handed out right now (rounded up to the size class/ page) and bytes of slabs backing them
+uint32_t kmalloc_bytes_in_use(void);
+uint32_t kmalloc_bytes_reserved(void);
+
+#endif
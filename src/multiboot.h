@@ -46,4 +46,30 @@ typedef struct multiboot_header_struct_t {
     uint8_t color_info[5];
 } multiboot_t;
 
+// Which multiboot_t fields are valid (flags):
+#define MULTIBOOT_INFO_MEMORY ((1 << 0))
+#define MULTIBOOT_INFO_MODS ((1 << 3))
+#define MULTIBOOT_INFO_MEM_MAP ((1 << 6))
+#define MULTIBOOT_INFO_FRAMEBUFFER_INFO ((1 << 12))
+
+// An entry of the mods_addr array:
+typedef struct multiboot_module_struct_t {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} multiboot_module_t;
+
+// An entry of the memory map at mmap_addr
+// size is the size of the rest of the entry (it doesn't count itself)
+typedef struct __attribute__((packed)) multiboot_mmap_entry_struct_t {
+    uint32_t size;
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;
+} multiboot_mmap_entry_t;
+
+// Usable RAM (everything else is reserved for something)
+#define MULTIBOOT_MEMORY_AVAILABLE ((1))
+
 #endif
\ No newline at end of file
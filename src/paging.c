@@ -2,23 +2,22 @@
 #include "defines.h"
 #include "x86_stuff.h"
 #include "vga.h"
+#include "util.h"
+#include "pmm.h"
 
-// Page directory (aligned to a page):
+// The kernel's page directory (aligned to a page):
+// Kernel processes run on this one, every other address space copies its entries (see as_switch)
 static pde_t page_dir[PD_NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 
-// Lower 4MB table:
-//static pte_t lower_page_table[PT_NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+// Page directory in CR3 right now:
+static pde_t *current_dir = page_dir;
+static uint32_t current_dir_phys = (uint32_t)page_dir;
 
-// Free page tables for use by map_page*:
-#define NUM_TABLES ((16))
-static pte_t free_page_tables[NUM_TABLES][PT_NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
-static bool free_page_tables_in_use[NUM_TABLES]; // Which tables are in use?
+// Bumped every time a kernel directory entry changes, so stale address spaces know to catch up
+static uint32_t kernel_gen = 0;
 
-// For use by alloc_huge_page:
-// First free huge page is the one after the filesystem:
-// Let's start allocating huge pages at 1MB (start of high memory in most x86 systems)
-#define FIRST_FREE_HUGE_PAGE ((((FS_PAGENUM + 3)) << 22))
-static bool free_huge_pages_in_use[NUM_HUGE_PAGES]; // Which huge pages are free for use by alloc_huge_page?
+// Lower 4MB table:
+//static pte_t lower_page_table[PT_NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 
 // Update page mappings by loading new_dir into CR3
 // This will flush TLB
@@ -30,96 +29,120 @@ void _load_page_dir(pde_t *new_dir) {
     );
 }
 
-// "Allocates" a page table by marking it as in-use
-// This will also initialize all fields to be empty
-pte_t *alloc_page_table() {
-    uint32_t i;
-    pte_t *page_table = NULL;
-    for (i = 0; i < NUM_TABLES; i++) {
-        if (!free_page_tables_in_use[i]) {
-            free_page_tables_in_use[i] = true;
-            page_table = (pte_t *)(&free_page_tables[i]);
-            break;
-        }
-    }
+// Flush the TLB (reloads CR3 with whatever is in it)
+// Global (kernel) entries survive this, see _flush_tlb_global
+static inline void _flush_tlb() {
+    _load_page_dir((pde_t *)current_dir_phys);
+}
 
-    // Setup and clear this page table:
-    if (page_table) {
-        for (i = 0; i < PT_NUM_ENTRIES; i++) {
-            page_table[i].present = 0;
-            page_table[i].val = 0;
-        }
+// CR4.PGE: TLB entries marked global stay cached when CR3 changes
+#define CR4_PGE ((1 << 7))
+#define CPUID_PGE ((1 << 13))
+static bool pge_enabled = false;
+
+// Flush everything, global entries too (toggling CR4.PGE does that)
+static void _flush_tlb_global() {
+    if (!pge_enabled) {
+        _flush_tlb();
+        return;
     }
+    asm volatile (
+        "movl %%cr4, %%eax\n" \
+        "andl %0, %%eax\n" \
+        "movl %%eax, %%cr4\n" \
+        "orl %1, %%eax\n" \
+        "movl %%eax, %%cr4" : : "i"(~CR4_PGE), "i"(CR4_PGE) : "eax"
+    );
+}
 
-    return page_table;
+// Page attribute table: lets PWT/ PCD (and the PAT bit) of an entry pick any memory type, not just WB/ WT/ UC
+// We only reprogram entry 1 (PWT set, PCD clear) to write-combining, the rest keep their power-on types
+#define CPUID_PAT ((1 << 16))
+#define MSR_PAT ((0x277))
+#define PAT_TYPE_WC ((0x01))
+#define PAT_ENTRY_WC ((1))
+static bool pat_enabled = false;
+
+static void _init_pat() {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(MSR_PAT));
+    lo = (lo & ~(0xFF << (PAT_ENTRY_WC * 8))) | (PAT_TYPE_WC << (PAT_ENTRY_WC * 8));
+
+    // Nothing cached or in the TLB may still be using the old type
+    asm volatile ("wbinvd" : : : "memory");
+    asm volatile ("wrmsr" : : "a"(lo), "d"(hi), "c"(MSR_PAT));
+    asm volatile ("wbinvd" : : : "memory");
+    _flush_tlb_global();
+    pat_enabled = true;
 }
 
-// Mark a page table allocated by alloc_page_table as being free
-// Please only call this with valid page table pointers allocated by alloc_page_table
-// otherwise terrible things will happen
-// Also do NOT call this on a page table that is mapped into a page directory
-void free_page_table (pte_t *table) {
-    if (!table) return;
-    // uint32_t offset_from_base = (table - &(free_page_tables[0]));
-
-    // // If table is less than free_page_tables, this difference will be huge
-    // // If table is larger than the end of free_page_tables, this difference will still
-    // // be bigger than NUM_TABLES
-    // if (offset_from_base < NUM_TABLES) {
-    //     free_page_tables_in_use[offset_from_base] = false;
-    // }
-
-    // The best portable C way to be 100% sure that a pointer points to an
-    // array is to traverse the array in O(n) time and check, apparently.
-    // Since freeing pages is rare, it's a small price to pay for salvation
-    uint32_t i;
-    for (i = 0; i < NUM_TABLES; i++) {
-        if (table == (pte_t*)&(free_page_tables[i])) {
-            free_page_tables_in_use[i] = false;
-            table->present = 0;
+bool paging_has_pat() {
+    return pat_enabled;
+}
+
+// Batched mapping (see paging_batch_begin)
+// Up to PAGING_BATCH_MAX pages get an invlpg each at the end, any more than that and we flush everything
+#define PAGING_BATCH_MAX ((32))
+static uint32_t batch_depth = 0;
+static uint32_t batch_flags;
+static uint32_t batch_num_pending = 0;
+static uint32_t batch_pending[PAGING_BATCH_MAX];
+static bool batch_overflow = false;
+
+static inline void _invlpg(uint32_t virt) {
+    asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// A mapping for virt changed, get it out of the TLB (now, or at the end of the batch)
+static inline void _tlb_invalidate(uint32_t virt) {
+    if (batch_depth > 0) {
+        if (batch_num_pending < PAGING_BATCH_MAX) {
+            batch_pending[batch_num_pending++] = virt;
         }
+        else {
+            batch_overflow = true;
+        }
+        return;
     }
+    _invlpg(virt);
+}
 
-    return;
+void paging_batch_begin() {
+    uint32_t flags = cli_and_save();
+    if (batch_depth == 0) {
+        batch_flags = flags;
+        batch_num_pending = 0;
+        batch_overflow = false;
+    }
+    batch_depth++;
 }
 
-/*
- * alloc_huge_page_virt
- *
- * Allocates a huge page (if possible) and returns virtual address to the caller.
- * On failure this returns a NULL address
- */
-uint32_t alloc_huge_page_virt () {
-    uint32_t i;
-    for (i = FIRST_FREE_HUGE_PAGE; i < PD_NUM_ENTRIES; i++) {
-        // Make use of the user-available bits to mark a page as having been allocated
-        // This allows some degree of thread safety
-        if (!page_dir[i].present && !page_dir[i].avail) {
-            page_dir[i].avail = 1;
-            return UNTAG_PDE(i);
+void paging_batch_end() {
+    if (batch_depth == 0) return;
+    batch_depth--;
+    if (batch_depth > 0) return;
+
+    if (batch_overflow) {
+        _flush_tlb_global();
+    }
+    else {
+        uint32_t i;
+        for (i = 0; i < batch_num_pending; i++) {
+            _tlb_invalidate(batch_pending[i]);
         }
     }
-    return NULL;
+    batch_num_pending = 0;
+    batch_overflow = false;
+    restore_flags(batch_flags);
 }
 
-/*
- * free_huge_page_virt
- *
- * Frees a huge page allocated by alloc_huge_page
- * If the requested page is not a huge page, doesn't do anything
- */
-void free_huge_page_virt (uint32_t idx) {
-    if (idx >= PD_NUM_ENTRIES) return;
-    if (!page_dir[idx].present) return;
-    if (page_dir[idx].size == 0) return;
-    page_dir[idx].val = 0;
-    page_dir[idx].present = 0;
-
-    // Mark this page as free for other alloc_huge_page calls:
-    // (Recal avail is the user-defined bits, I am setting it to 0
-    // if not allocated by alloc_huge_page, and 1 if it was).
-    // This allows pages to be marked as allocated but not present.
-    page_dir[idx].avail = 0;
+// A kernel directory entry changed, copy it into the live address space too
+// (every other address space picks it up next time it's switched to)
+static void _kernel_pde_changed(uint32_t idx) {
+    if (current_dir != page_dir && !(current_dir[idx].avail & PDE_AVAIL_PRIVATE)) {
+        current_dir[idx] = page_dir[idx];
+    }
+    kernel_gen++;
 }
 
 /*
@@ -129,14 +152,7 @@ void free_huge_page_virt (uint32_t idx) {
  * On failure this returns a NULL address.
  */
 void *alloc_huge_page () {
-    uint32_t i;
-    for (i = 0; i < NUM_HUGE_PAGES; i++) {
-        if (!free_huge_pages_in_use[i]) {
-            free_huge_pages_in_use[i] = true;
-            return (void *)(UNTAG_PDE(i)) + FIRST_FREE_HUGE_PAGE;
-        }
-    }
-    return NULL;
+    return pmm_alloc(PMM_HUGE_ORDER);
 }
 
 /*
@@ -145,23 +161,7 @@ void *alloc_huge_page () {
  * Frees a page allocated by alloc_huge_page
  */
 void free_huge_page(void *pg_ptr) {
-    uint32_t pg = (uint32_t)pg_ptr;
-    uint32_t pg_idx = TAG_PDE(pg - FIRST_FREE_HUGE_PAGE);
-    if (pg_idx < NUM_HUGE_PAGES) {
-        free_huge_pages_in_use[pg_idx] = false;
-    }
-}
-
-/*
- * _enable_huge_allocator
- *
- * Sets up data structures needed by huge page allocator
- */
-void _enable_huge_allocator() {
-    uint32_t i;
-    for (i = 0; i < NUM_HUGE_PAGES; i++) {
-        free_huge_pages_in_use[i] = false;
-    }
+    pmm_free(pg_ptr, PMM_HUGE_ORDER);
 }
 
 bool map_huge_page (uint32_t virt, uint32_t phys, bool user_page, bool writeable) {
@@ -172,10 +172,27 @@ bool map_huge_page (uint32_t virt, uint32_t phys, bool user_page, bool writeable
     page_dir[virt_dir_idx].size = 1;
     page_dir[virt_dir_idx].user_supervisor = user_page;
     page_dir[virt_dir_idx].read_write = writeable;
+    page_dir[virt_dir_idx].write_through = 0; // Default memory type (see map_huge_page_kern_wc)
+    page_dir[virt_dir_idx].cache_disabled = 0;
+    page_dir[virt_dir_idx].global = 1; // Same in every address space
     page_dir[virt_dir_idx].present = 1;
+    _kernel_pde_changed(virt_dir_idx);
+
+    // Drop the old translation:
+    _tlb_invalidate(virt);
+    return true;
+}
 
-    // Flush TLB and update page mappings:
-    _load_page_dir(&(page_dir[0]));
+bool map_huge_page_kern_wc(uint32_t virt, uint32_t phys) {
+    if (!map_huge_page(virt, phys, false, true)) return false;
+
+    // Without PAT, PWT would just make it write-through, so leave it at whatever the MTRRs say
+    if (!pat_enabled) return true;
+
+    uint32_t virt_dir_idx = DIR_IDX(virt);
+    page_dir[virt_dir_idx].write_through = 1; // PAT entry 1, write-combining
+    _kernel_pde_changed(virt_dir_idx);
+    _tlb_invalidate(virt);
     return true;
 }
 
@@ -188,10 +205,532 @@ void unmap_huge_page(uint32_t virt) {
     page_dir[virt_dir_idx].size = 1;
     page_dir[virt_dir_idx].user_supervisor = 0;
     page_dir[virt_dir_idx].read_write = 0;
+    page_dir[virt_dir_idx].global = 0;
 
     // Unmap it
     page_dir[virt_dir_idx].present = 0;
-    _load_page_dir(&(page_dir[0]));
+    _kernel_pde_changed(virt_dir_idx);
+    _tlb_invalidate(virt);
+}
+
+// Which slots of the kernel heap window are mapped?
+static void *kheap_phys[KHEAP_NUM_HUGE_PAGES];
+
+// And the other way around: kernel heap slot + 1 of each physical huge page (0 if it isn't in the heap)
+static uint8_t kheap_slot_of[PMM_MAX_PHYS >> 22];
+
+// Which slots were chopped up into 4kb pages by kernel_alloc_page?
+static bool kheap_chopped[KHEAP_NUM_HUGE_PAGES];
+
+// Which slots hold runs of pages from kernel_alloc_pages?
+static bool kheap_runs[KHEAP_NUM_HUGE_PAGES];
+
+void *kernel_alloc_huge_page() {
+    uint32_t i;
+    uint32_t flags = cli_and_save();
+    for (i = 0; i < KHEAP_NUM_HUGE_PAGES; i++) {
+        if (NULL == kheap_phys[i]) {
+            void *phys = alloc_huge_page();
+            if (!phys) break;
+
+            uint32_t virt = KHEAP_VIRT_ADDR + UNTAG_PDE(i);
+            kheap_phys[i] = phys;
+            kheap_slot_of[TAG_PDE((uint32_t)phys)] = i + 1;
+            map_huge_page_kern(virt, (uint32_t)phys);
+            restore_flags(flags);
+            return (void *)virt;
+        }
+    }
+    restore_flags(flags);
+    return NULL;
+}
+
+void kernel_free_huge_page(void *virt) {
+    uint32_t i = TAG_PDE((uint32_t)virt - KHEAP_VIRT_ADDR);
+    if (i >= KHEAP_NUM_HUGE_PAGES) return;
+
+    uint32_t flags = cli_and_save();
+    if (kheap_phys[i]) {
+        unmap_huge_page((uint32_t)virt);
+        kheap_slot_of[TAG_PDE((uint32_t)kheap_phys[i])] = 0;
+        kheap_chopped[i] = false;
+        free_huge_page(kheap_phys[i]);
+        kheap_phys[i] = NULL;
+    }
+    restore_flags(flags);
+}
+
+// Free 4kb pages, linked through their first word:
+static void *kheap_free_pages = NULL;
+
+void *kernel_alloc_page() {
+    uint32_t flags = cli_and_save();
+    if (NULL == kheap_free_pages) {
+        // Out of small pages, chop up another huge page:
+        uint8_t *huge = kernel_alloc_huge_page();
+        if (!huge) {
+            restore_flags(flags);
+            return NULL;
+        }
+
+        kheap_chopped[TAG_PDE((uint32_t)huge - KHEAP_VIRT_ADDR)] = true;
+
+        uint32_t i;
+        for (i = 0; i < HUGE_PAGE_SIZE; i += PAGE_SIZE) {
+            *(void **)(huge + i) = kheap_free_pages;
+            kheap_free_pages = huge + i;
+        }
+    }
+
+    void *page = kheap_free_pages;
+    kheap_free_pages = *(void **)page;
+    restore_flags(flags);
+    return page;
+}
+
+void kernel_free_page(void *virt) {
+    if (!virt) return;
+    uint32_t flags = cli_and_save();
+    *(void **)virt = kheap_free_pages;
+    kheap_free_pages = virt;
+    restore_flags(flags);
+}
+
+bool kernel_is_huge_page(void *virt) {
+    uint32_t i = TAG_PDE((uint32_t)virt - KHEAP_VIRT_ADDR);
+    if (i >= KHEAP_NUM_HUGE_PAGES || ((uint32_t)virt & (HUGE_PAGE_SIZE - 1))) return false;
+    return kheap_phys[i] != NULL && !kheap_chopped[i] && !kheap_runs[i];
+}
+
+// Runs of 4kb pages (kernel_alloc_pages) come out of their own huge pages.
+// Per huge page: which pages are in use, and which page is the last one of its run
+// (so kernel_free_pages knows how far to go)
+#define KHEAP_RUN_WORDS ((HUGE_PAGE_SIZE / PAGE_SIZE / 32))
+static uint32_t kheap_run_used[KHEAP_NUM_HUGE_PAGES][KHEAP_RUN_WORDS];
+static uint32_t kheap_run_end[KHEAP_NUM_HUGE_PAGES][KHEAP_RUN_WORDS];
+static uint32_t kheap_run_num_used[KHEAP_NUM_HUGE_PAGES];
+
+#define KHEAP_BIT_TEST(map, n) (((map)[(n) / 32] >> ((n) % 32)) & 0x01)
+#define KHEAP_BIT_SET(map, n) ((map)[(n) / 32] |= (1U << ((n) % 32)))
+#define KHEAP_BIT_CLEAR(map, n) ((map)[(n) / 32] &= ~(1U << ((n) % 32)))
+
+// First page of pages free pages in a row in run slot i (KHEAP_RUN_WORDS * 32 if there isn't one)
+static uint32_t _kheap_run_find(uint32_t i, uint32_t pages) {
+    uint32_t page, free_in_a_row = 0;
+    for (page = 0; page < KHEAP_RUN_WORDS * 32; page++) {
+        if (KHEAP_BIT_TEST(kheap_run_used[i], page)) {
+            free_in_a_row = 0;
+            continue;
+        }
+        if (++free_in_a_row == pages) return page + 1 - pages;
+    }
+    return KHEAP_RUN_WORDS * 32;
+}
+
+void *kernel_alloc_pages(uint32_t pages) {
+    if (pages == 0 || pages > KHEAP_RUN_WORDS * 32) return NULL;
+    uint32_t flags = cli_and_save();
+    uint32_t i, first = KHEAP_RUN_WORDS * 32;
+
+    for (i = 0; i < KHEAP_NUM_HUGE_PAGES; i++) {
+        if (!kheap_runs[i]) continue;
+        first = _kheap_run_find(i, pages);
+        if (first < KHEAP_RUN_WORDS * 32) break;
+    }
+
+    if (i == KHEAP_NUM_HUGE_PAGES) {
+        // Nothing big enough, start a new huge page:
+        uint8_t *huge = kernel_alloc_huge_page();
+        if (!huge) {
+            restore_flags(flags);
+            return NULL;
+        }
+        i = TAG_PDE((uint32_t)huge - KHEAP_VIRT_ADDR);
+        kheap_runs[i] = true;
+        kheap_run_num_used[i] = 0;
+        memsetl(kheap_run_used[i], 0, KHEAP_RUN_WORDS);
+        memsetl(kheap_run_end[i], 0, KHEAP_RUN_WORDS);
+        first = 0;
+    }
+
+    uint32_t page;
+    for (page = first; page < first + pages; page++) {
+        KHEAP_BIT_SET(kheap_run_used[i], page);
+    }
+    KHEAP_BIT_SET(kheap_run_end[i], first + pages - 1);
+    kheap_run_num_used[i] += pages;
+
+    restore_flags(flags);
+    return (void *)(KHEAP_VIRT_ADDR + UNTAG_PDE(i) + first * PAGE_SIZE);
+}
+
+uint32_t kernel_free_pages(void *virt) {
+    if (!kernel_is_pages(virt)) return 0;
+    uint32_t flags = cli_and_save();
+    uint32_t i = TAG_PDE((uint32_t)virt - KHEAP_VIRT_ADDR);
+    uint32_t page = ((uint32_t)virt & (HUGE_PAGE_SIZE - 1)) / PAGE_SIZE;
+    uint32_t freed = 0;
+
+    while (page < KHEAP_RUN_WORDS * 32 && KHEAP_BIT_TEST(kheap_run_used[i], page)) {
+        bool last = KHEAP_BIT_TEST(kheap_run_end[i], page);
+        KHEAP_BIT_CLEAR(kheap_run_used[i], page);
+        KHEAP_BIT_CLEAR(kheap_run_end[i], page);
+        freed++;
+        page++;
+        if (last) break;
+    }
+    kheap_run_num_used[i] -= freed;
+
+    // Give the huge page back once it's empty:
+    if (0 == kheap_run_num_used[i]) {
+        kheap_runs[i] = false;
+        kernel_free_huge_page((void *)(KHEAP_VIRT_ADDR + UNTAG_PDE(i)));
+    }
+    restore_flags(flags);
+    return freed;
+}
+
+uint32_t kernel_pages_len(void *virt) {
+    if (!kernel_is_pages(virt)) return 0;
+    uint32_t flags = cli_and_save();
+    uint32_t i = TAG_PDE((uint32_t)virt - KHEAP_VIRT_ADDR);
+    uint32_t page = ((uint32_t)virt & (HUGE_PAGE_SIZE - 1)) / PAGE_SIZE;
+    uint32_t len = 0;
+
+    while (page < KHEAP_RUN_WORDS * 32 && KHEAP_BIT_TEST(kheap_run_used[i], page)) {
+        len++;
+        if (KHEAP_BIT_TEST(kheap_run_end[i], page)) break;
+        page++;
+    }
+    restore_flags(flags);
+    return len;
+}
+
+bool kernel_is_pages(void *virt) {
+    uint32_t i = TAG_PDE((uint32_t)virt - KHEAP_VIRT_ADDR);
+    if ((uint32_t)virt < KHEAP_VIRT_ADDR || i >= KHEAP_NUM_HUGE_PAGES || ((uint32_t)virt & (PAGE_SIZE - 1))) return false;
+    return kheap_phys[i] != NULL && kheap_runs[i];
+}
+
+// Physical address of something in the kernel heap window or the kernel image
+static uint32_t _kernel_virt_to_phys(void *virt) {
+    uint32_t addr = (uint32_t)virt;
+    if (addr >= KHEAP_VIRT_ADDR) {
+        uint32_t i = TAG_PDE(addr - KHEAP_VIRT_ADDR);
+        if (i < KHEAP_NUM_HUGE_PAGES && kheap_phys[i]) {
+            return (uint32_t)kheap_phys[i] + (addr & (HUGE_PAGE_SIZE - 1));
+        }
+    }
+
+    // Kernel image is identity mapped
+    return addr;
+}
+
+// Where to find a physical address from _kernel_virt_to_phys (in the heap window or kernel image)
+static void *_kernel_phys_to_virt(uint32_t phys) {
+    if (phys < PMM_MAX_PHYS && kheap_slot_of[TAG_PDE(phys)]) {
+        uint32_t slot = kheap_slot_of[TAG_PDE(phys)] - 1;
+        return (void *)(KHEAP_VIRT_ADDR + UNTAG_PDE(slot) + (phys & (HUGE_PAGE_SIZE - 1)));
+    }
+    return (void *)phys;
+}
+
+/*******************
+ * Page tables
+ *******************/
+
+// Page tables are 4kb kernel heap pages (so the kernel can always write them through the heap window)
+// For every heap page we keep whether it's a page table, and if so how many of its entries are present.
+#define KHEAP_NUM_PAGES ((KHEAP_NUM_HUGE_PAGES * (HUGE_PAGE_SIZE / PAGE_SIZE)))
+static uint32_t page_table_bitmap[KHEAP_NUM_PAGES / 32];
+static uint16_t page_table_used[KHEAP_NUM_PAGES];
+
+// Index of a kernel heap page (KHEAP_NUM_PAGES if it isn't one)
+static inline uint32_t _kheap_page_idx(void *virt) {
+    uint32_t addr = (uint32_t)virt;
+    if (addr < KHEAP_VIRT_ADDR || (addr & (PAGE_SIZE - 1))) return KHEAP_NUM_PAGES;
+    uint32_t idx = TAG(addr - KHEAP_VIRT_ADDR);
+    return (idx < KHEAP_NUM_PAGES) ? idx : KHEAP_NUM_PAGES;
+}
+
+/*
+ * alloc_page_table
+ *
+ * Allocates an empty page table, and writes its physical address (for the PDE) to phys.
+ * Returns NULL if we're out of memory.
+ */
+pte_t *alloc_page_table(uint32_t *phys) {
+    pte_t *table = kernel_alloc_page();
+    if (!table) return NULL;
+
+    memsetl(table, 0, PT_NUM_ENTRIES);
+
+    uint32_t idx = _kheap_page_idx(table);
+    page_table_bitmap[idx / 32] |= (1U << (idx % 32));
+    page_table_used[idx] = 0;
+
+    if (phys) *phys = _kernel_virt_to_phys(table);
+    return table;
+}
+
+// Give a page table from alloc_page_table back
+// Anything that isn't one is ignored (O(1) check)
+// Do NOT call this on a page table that is mapped into a page directory
+void free_page_table (pte_t *table) {
+    uint32_t idx = _kheap_page_idx(table);
+    if (idx >= KHEAP_NUM_PAGES) return;
+    if (!(page_table_bitmap[idx / 32] & (1U << (idx % 32)))) return;
+
+    page_table_bitmap[idx / 32] &= ~(1U << (idx % 32));
+    kernel_free_page(table);
+}
+
+// The page table a (present, not huge) PDE points to
+static inline pte_t *_pde_table(pde_t *pde) {
+    return (pte_t *)_kernel_phys_to_virt(UNTAG(pde->phys_addr));
+}
+
+/*******************
+ * Scratch mappings
+ *******************/
+
+void *scratch_map_page(uint32_t slot, uint32_t phys) {
+    if (slot >= SCRATCH_NUM_SLOTS) return NULL;
+    uint32_t virt = SCRATCH_VIRT_ADDR + slot * PAGE_SIZE;
+    if (!map_page(virt, phys, false, true)) return NULL;
+
+    // Can't wait for the end of a batch, we're about to use it
+    _invlpg(virt);
+    return (void *)virt;
+}
+
+void zero_page_phys(uint32_t phys) {
+    uint32_t flags = cli_and_save();
+    void *page = scratch_map_page(SCRATCH_SLOT_ZERO, phys);
+    if (page) memsetl(page, 0, PAGE_SIZE / sizeof(uint32_t));
+    restore_flags(flags);
+}
+
+void *scratch_map_huge_page(uint32_t phys) {
+    if (!map_huge_page(SCRATCH_HUGE_VIRT_ADDR, phys, false, true)) return NULL;
+    _invlpg(SCRATCH_HUGE_VIRT_ADDR);
+    return (void *)SCRATCH_HUGE_VIRT_ADDR;
+}
+
+void zero_huge_page_phys(uint32_t phys) {
+    uint32_t flags = cli_and_save();
+    void *page = scratch_map_huge_page(phys);
+    if (page) memsetl(page, 0, HUGE_PAGE_SIZE / sizeof(uint32_t));
+    restore_flags(flags);
+}
+
+/*******************
+ * Address spaces
+ *******************/
+void as_init_kernel(addr_space_t *as) {
+    if (!as) return;
+    as->dir = page_dir;
+    as->dir_phys = (uint32_t)page_dir;
+    as->kernel_gen = kernel_gen;
+}
+
+bool as_create(addr_space_t *as) {
+    if (!as) return false;
+    uint32_t flags = cli_and_save();
+
+    pde_t *dir = kernel_alloc_page();
+    if (!dir) {
+        restore_flags(flags);
+        return false;
+    }
+
+    // Start out with just the kernel's mappings:
+    uint32_t i;
+    for (i = 0; i < PD_NUM_ENTRIES; i++) {
+        dir[i] = page_dir[i];
+    }
+
+    as->dir = dir;
+    as->dir_phys = _kernel_virt_to_phys(dir);
+    as->kernel_gen = kernel_gen;
+    restore_flags(flags);
+    return true;
+}
+
+void as_destroy(addr_space_t *as) {
+    if (!as || !as->dir || as->dir == page_dir) return;
+    uint32_t flags = cli_and_save();
+
+    // Can't free the directory out from under the CPU
+    if (as->dir == current_dir) {
+        current_dir = page_dir;
+        current_dir_phys = (uint32_t)page_dir;
+        _flush_tlb();
+    }
+
+    // Free its own page tables (whatever they point to is up to the owner, see vma.c)
+    uint32_t i;
+    for (i = 0; i < PD_NUM_ENTRIES; i++) {
+        if (as->dir[i].present && !as->dir[i].size && (as->dir[i].avail & PDE_AVAIL_PRIVATE)) {
+            free_page_table(_pde_table(&as->dir[i]));
+        }
+    }
+
+    kernel_free_page(as->dir);
+    as->dir = NULL;
+    restore_flags(flags);
+}
+
+void as_switch(addr_space_t *as) {
+    if (!as || !as->dir) return;
+    uint32_t flags = cli_and_save();
+
+    // Catch up on kernel mappings made since we last ran
+    if (as->kernel_gen != kernel_gen) {
+        uint32_t i;
+        for (i = 0; i < PD_NUM_ENTRIES; i++) {
+            if (!(as->dir[i].avail & PDE_AVAIL_PRIVATE)) {
+                as->dir[i] = page_dir[i];
+            }
+        }
+        as->kernel_gen = kernel_gen;
+    }
+
+    // Processes sharing an address space (every kernel process) don't need to touch CR3
+    if (as->dir_phys != current_dir_phys) {
+        current_dir = as->dir;
+        current_dir_phys = as->dir_phys;
+        _flush_tlb();
+    }
+    restore_flags(flags);
+}
+
+bool as_is_current(addr_space_t *as) {
+    return as && as->dir && as->dir == current_dir;
+}
+
+bool as_map_huge_page(addr_space_t *as, uint32_t virt, uint32_t phys, bool user_page, bool writeable) {
+    if (!as || !as->dir || as->dir == page_dir) return false;
+    uint32_t idx = DIR_IDX(virt);
+
+    pde_t entry;
+    entry.val = 0;
+    entry.phys_addr = TAG(phys);
+    entry.size = 1;
+    entry.user_supervisor = user_page;
+    entry.read_write = writeable;
+    entry.avail = PDE_AVAIL_PRIVATE;
+    entry.present = 1;
+    as->dir[idx] = entry;
+
+    if (as->dir == current_dir) _tlb_invalidate(virt);
+    return true;
+}
+
+uint32_t as_unmap_huge_page(addr_space_t *as, uint32_t virt) {
+    if (!as || !as->dir || as->dir == page_dir) return 0;
+    uint32_t idx = DIR_IDX(virt);
+
+    pde_t old = as->dir[idx];
+    if (!old.present || !old.size || !(old.avail & PDE_AVAIL_PRIVATE)) return 0;
+
+    // Whatever the kernel has here comes back (usually nothing)
+    as->dir[idx] = page_dir[idx];
+    if (as->dir == current_dir) _tlb_invalidate(virt);
+    return UNTAG(old.phys_addr);
+}
+
+void as_inherit_huge_page(addr_space_t *as, uint32_t virt) {
+    if (!as || !as->dir || as->dir == page_dir || as->dir == current_dir) return;
+    uint32_t idx = DIR_IDX(virt);
+
+    // Only huge pages, a page table belongs to its address space (and is freed with it)
+    // (and never over one of as's own page tables)
+    if (as->dir[idx].present && !as->dir[idx].size && (as->dir[idx].avail & PDE_AVAIL_PRIVATE)) return;
+    if (current_dir[idx].present && current_dir[idx].size && (current_dir[idx].avail & PDE_AVAIL_PRIVATE)) {
+        as->dir[idx] = current_dir[idx];
+    }
+}
+
+bool as_map_page(addr_space_t *as, uint32_t virt, uint32_t phys, bool user_page, bool writeable) {
+    if (!as || !as->dir || as->dir == page_dir) return false;
+    uint32_t idx = DIR_IDX(virt);
+    pde_t *pde = &as->dir[idx];
+    pte_t *page_table;
+
+    if (!pde->present || !(pde->avail & PDE_AVAIL_PRIVATE)) {
+        // Can't put a private table over a kernel mapping
+        if (pde->present) return false;
+
+        uint32_t table_phys;
+        page_table = alloc_page_table(&table_phys);
+        if (!page_table) return false;
+
+        // Permissions are up to each PTE
+        pde_t entry;
+        entry.val = 0;
+        entry.phys_addr = TAG(table_phys);
+        entry.user_supervisor = 1;
+        entry.read_write = 1;
+        entry.avail = PDE_AVAIL_PRIVATE;
+        entry.present = 1;
+        *pde = entry;
+    }
+    else if (pde->size) {
+        return false;
+    }
+    else {
+        page_table = _pde_table(pde);
+    }
+
+    pte_t *pte = &page_table[PAGE_IDX(virt)];
+    if (!pte->present) {
+        page_table_used[_kheap_page_idx(page_table)]++;
+    }
+
+    pte_t entry;
+    entry.val = 0;
+    entry.phys_addr = TAG(phys);
+    entry.user_supervisor = user_page;
+    entry.read_write = writeable;
+    entry.present = 1;
+    *pte = entry;
+
+    if (as->dir == current_dir) _tlb_invalidate(PAGE_ALIGN(virt));
+    return true;
+}
+
+uint32_t as_unmap_page(addr_space_t *as, uint32_t virt) {
+    if (!as || !as->dir || as->dir == page_dir) return 0;
+    uint32_t idx = DIR_IDX(virt);
+    pde_t *pde = &as->dir[idx];
+    if (!pde->present || pde->size || !(pde->avail & PDE_AVAIL_PRIVATE)) return 0;
+
+    pte_t *page_table = _pde_table(pde);
+    pte_t *pte = &page_table[PAGE_IDX(virt)];
+    if (!pte->present) return 0;
+
+    uint32_t phys = UNTAG(pte->phys_addr);
+    pte->val = 0;
+    if (as->dir == current_dir) _tlb_invalidate(PAGE_ALIGN(virt));
+
+    // That was the last page in this table, give it back:
+    if (0 == --page_table_used[_kheap_page_idx(page_table)]) {
+        as->dir[idx] = page_dir[idx];
+        free_page_table(page_table);
+    }
+    return phys;
+}
+
+uint32_t as_virt_to_phys(addr_space_t *as, uint32_t virt) {
+    if (!as || !as->dir) return 0;
+    pde_t *pde = &as->dir[DIR_IDX(virt)];
+    if (!pde->present) return 0;
+    if (pde->size) return UNTAG(pde->phys_addr) + (virt & (HUGE_PAGE_SIZE - 1));
+
+    pte_t *pte = &_pde_table(pde)[PAGE_IDX(virt)];
+    if (!pte->present) return 0;
+    return UNTAG(pte->phys_addr) + OFFSET(virt);
 }
 
 // Map a virtual address to physical address, write into CR3
@@ -209,20 +748,22 @@ bool map_page(uint32_t virt, uint32_t phys, bool user_page, bool writeable) {
     pte_t *page_table = NULL;
     if (!page_dir[virt_dir_idx].present) {
         // No page table present at this directory entry
-        // Allocate a page table from the free tables
-        page_table = alloc_page_table();
+        // Allocate a new page table
+        uint32_t table_phys;
+        page_table = alloc_page_table(&table_phys);
 
-        // No free page tables, can't allocate this address
+        // Out of memory, can't allocate this address
         if (!page_table) {
             return false;
         }
 
-        // Write the found page table into the directory:
-        page_dir[virt_dir_idx].phys_addr = TAG((uint32_t)(page_table));
+        // Write the new page table into the directory:
+        page_dir[virt_dir_idx].phys_addr = TAG(table_phys);
         page_dir[virt_dir_idx].size = 0;
         page_dir[virt_dir_idx].user_supervisor = user_page;
         page_dir[virt_dir_idx].read_write = writeable;
         page_dir[virt_dir_idx].present = 1;
+        _kernel_pde_changed(virt_dir_idx);
     }
     else if (page_dir[virt_dir_idx].present && page_dir[virt_dir_idx].size == 1) {
         // This is a huge page! Can't map a small page into it
@@ -230,52 +771,65 @@ bool map_page(uint32_t virt, uint32_t phys, bool user_page, bool writeable) {
     }
     else {
         // Get a pointer to the page table already in use here
-        page_table = (pte_t*)(UNTAG(page_dir[virt_dir_idx].phys_addr));
+        page_table = _pde_table(&page_dir[virt_dir_idx]);
+    }
+
+    if (!page_table[virt_page_idx].present) {
+        page_table_used[_kheap_page_idx(page_table)]++;
     }
 
     // We have a valid page directory pointing to a valid page table
     page_table[virt_page_idx].phys_addr = TAG(phys);
     page_table[virt_page_idx].user_supervisor = user_page;
     page_table[virt_page_idx].read_write = writeable;
+    page_table[virt_page_idx].global = 1; // Same in every address space
     page_table[virt_page_idx].present = 1;
 
-    // Reload the page mapping:
-    // (This will flush TLB)
-    _load_page_dir(&page_dir[0]);
+    // Drop the old translation:
+    _tlb_invalidate(virt);
     return true;
 }
 
+void unmap_page(uint32_t virt) {
+    uint32_t virt_dir_idx = DIR_IDX(virt);
+    uint32_t virt_page_idx = PAGE_IDX(virt);
+    if (!page_dir[virt_dir_idx].present || page_dir[virt_dir_idx].size == 1) return;
+
+    pte_t *page_table = _pde_table(&page_dir[virt_dir_idx]);
+    if (!page_table[virt_page_idx].present) return;
+
+    page_table[virt_page_idx].val = 0;
+    _tlb_invalidate(PAGE_ALIGN(virt));
+
+    // That was the last page in this table, give it back:
+    uint32_t table_idx = _kheap_page_idx(page_table);
+    if (0 == --page_table_used[table_idx]) {
+        page_dir[virt_dir_idx].val = 0;
+        _kernel_pde_changed(virt_dir_idx);
+        free_page_table(page_table);
+    }
+}
+
 // Setup default page tables and directories, write into CR3
 void enable_paging () {
     int i;
     // (Assumption: kernel fits into 1 huge page)
 
-    // Enable all free pages:
-    for (i = 0; i < NUM_TABLES; i++) {
-        free_page_tables_in_use[i] = false;
-    }
-
-    // Setup huge page allocator
-    _enable_huge_allocator();
-
     // Disable all pages in directory:
     for (i = 0; i < PD_NUM_ENTRIES; i++) {
         page_dir[i].val = 0;
     }
 
-    // Map a huge page for the kernel and
-    // a page table containing video memory
+    // Map a huge page for the kernel
+    // (Video memory comes after paging is on, its page table lives in the kernel heap)
     // Kernel huge page:
     map_huge_page_kern ((uint32_t)&kernel_slide, (uint32_t)&kernel_slide);
 
-    // Video memory & lower page table:
-    map_page_kern (VGA_VIDMEM, VGA_VIDMEM);
-
     // Update page tables:
     // (Manual says that a jump instruction should follow changing CR3)
-    asm volatile (
-        "movl %%eax, %%cr3" : : "a"(&page_dir)
-    );
+    current_dir = page_dir;
+    current_dir_phys = (uint32_t)page_dir;
+    _flush_tlb();
 
     // Enable paging:
     // IA 32 Manual Page 4-4 Vol 3.A says CR4.PSE must be enabled for huge pages
@@ -288,11 +842,32 @@ void enable_paging () {
     );
 
     // Enable paging (bit 31 of CR0)
+    // Also honor read only pages in the kernel (WP, bit 16), so the kernel writing to a
+    // copy-on-write user page during a syscall faults and gets its own copy too
     asm volatile (
         "movl %%cr0, %%eax\n"
-        "orl $0x80000000, %%eax\n" \
+        "orl $0x80010000, %%eax\n" \
         "movl %%eax, %%cr0" : : : "eax"
     );
+
+    // Keep kernel mappings (marked global) in the TLB across CR3 writes, if the CPU can
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (edx & CPUID_PGE) {
+        asm volatile (
+            "movl %%cr4, %%eax\n" \
+            "orl %0, %%eax\n" \
+            "movl %%eax, %%cr4" : : "i"(CR4_PGE) : "eax"
+        );
+        pge_enabled = true;
+    }
+
+    if (edx & CPUID_PAT) {
+        _init_pat();
+    }
+
+    // Video memory & lower page table:
+    map_page_kern (VGA_VIDMEM, VGA_VIDMEM);
 }
 
 // Maps a single huge page for the filesystem
@@ -301,12 +876,16 @@ void *map_filesys_pages(void *fs_root) {
     uint32_t virt_root = ((uint32_t)fs_root + (FS_PAGENUM << 22));
     uint32_t end_addr = ((FS_PAGENUM + 1) << 22);
 
+    // One TLB flush for the lot, not one per page:
+    paging_batch_begin();
     uint32_t i;
     for (i = virt_root; i < end_addr; i += PAGE_SIZE) {
         if (!map_page(virt_root + (i-virt_root), (uint32_t)fs_root + (i-virt_root), false, true)) {
+            paging_batch_end();
             return NULL;
         }
     }
+    paging_batch_end();
 
     // Return the final address:
     return (void *)virt_root;
@@ -70,9 +70,7 @@ typedef struct __attribute__((packed)) pte_struct_t {
 #define PD_NUM_ENTRIES ((PAGE_SIZE/sizeof(pde_t)))
 #define PT_NUM_ENTRIES ((PAGE_SIZE/sizeof(pte_t)))
 
-// @TODO: Set this by reading multiboot high memory size
-// The number of huge pages after 1 MB we that are free for allocating
-#define NUM_HUGE_PAGES ((1024))
+// Allocate/ free a physical huge page (from the PMM, see pmm.h)
 void *alloc_huge_page ();
 void free_huge_page(void *pg_ptr);
 
@@ -91,9 +89,134 @@ bool map_huge_page_kern(uint32_t virt, uint32_t phys);
 bool map_huge_page_user(uint32_t virt, uint32_t phys);
 bool map_huge_page_user_readonly(uint32_t virt, uint32_t phys);
 
+// Map a huge page of MMIO (the framebuffer) for the kernel, write-combining
+// Stores get merged into bursts instead of going out one by one. Without PAT it's mapped like map_huge_page_kern.
+bool map_huge_page_kern_wc(uint32_t virt, uint32_t phys);
+
+// Did we get to program the PAT (is map_huge_page_kern_wc actually write-combining)?
+bool paging_has_pat(void);
+
 // Unmap a huge page:
 void unmap_huge_page(uint32_t virt);
 
+// Unmap a 4kb page (its page table is freed once nothing else is mapped in it):
+void unmap_page(uint32_t virt);
+
+// Kernel mappings (everything above) are marked global, so they stay in the TLB across
+// address space switches. Changing one only invalidates that page (invlpg).
+
+/*
+ * paging_batch_begin/ paging_batch_end
+ *
+ * Mapping lots of pages? Wrap it in these and the TLB is only touched once, at the end.
+ * Batches nest, and interrupts are off in between.
+ */
+void paging_batch_begin(void);
+void paging_batch_end(void);
+
+// Kernel heap window:
+// Huge pages mapped (kernel only) for the kernel's own allocators (see slab.c)
+#define KHEAP_VIRT_ADDR ((0xE0000000))
+#define KHEAP_NUM_HUGE_PAGES ((64))
+
+// Allocate and map a huge page in the kernel heap window, returns its virtual address (NULL on failure)
+void *kernel_alloc_huge_page(void);
+void kernel_free_huge_page(void *virt);
+
+// Allocate a 4kb page from the kernel heap window (carved out of kernel huge pages)
+void *kernel_alloc_page(void);
+void kernel_free_page(void *virt);
+
+/*
+ * kernel_alloc_pages
+ *
+ * Allocate pages 4kb pages in a row from the kernel heap window (up to a huge page's worth).
+ * Runs are packed into huge pages of their own, so something a little over 4kb doesn't cost 4MB.
+ * Returns the virtual address of the first one (NULL on failure).
+ */
+void *kernel_alloc_pages(uint32_t pages);
+
+// Free a run from kernel_alloc_pages (virt has to be its first page), returns how many pages it was
+uint32_t kernel_free_pages(void *virt);
+
+// Number of pages in the run starting at virt (0 if it isn't one)
+uint32_t kernel_pages_len(void *virt);
+
+// Did virt come from kernel_alloc_huge_page (and not kernel_alloc_page or kernel_alloc_pages)?
+bool kernel_is_huge_page(void *virt);
+
+// Did virt come from kernel_alloc_pages?
+bool kernel_is_pages(void *virt);
+
+// Scratch windows (kernel only) for getting at physical memory that isn't mapped anywhere handy,
+// like frames that are about to go into another address space
+#define SCRATCH_VIRT_ADDR ((0xDF800000))
+#define SCRATCH_HUGE_VIRT_ADDR ((0xDFC00000))
+
+// Slots in the 4kb scratch window (one per user, so they don't step on each other):
+#define SCRATCH_SLOT_ZERO ((0))
+#define SCRATCH_SLOT_FILL ((1))
+#define SCRATCH_SLOT_COPY ((2))
+#define SCRATCH_NUM_SLOTS ((4))
+
+// Map a 4kb frame at its scratch slot and return where
+// Interrupts have to stay off until you're done with it (the next user of the slot remaps it)
+void *scratch_map_page(uint32_t slot, uint32_t phys);
+
+// Same for a huge page (there's only the one huge window)
+void *scratch_map_huge_page(uint32_t phys);
+
+// Zero a 4kb frame/ a huge page by physical address
+void zero_page_phys(uint32_t phys);
+void zero_huge_page_phys(uint32_t phys);
+
+// Address spaces
+// Every user process has its own page directory. Entries it maps for itself (its ELF image, mmap)
+// are private, everything else is the kernel's and is shared with the kernel's directory.
+// Kernel mappings made while an address space isn't loaded get copied in next time it is (as_switch).
+// Kernel processes all share the kernel's directory, so switching between them doesn't touch CR3.
+typedef struct addr_space_t {
+    // Page directory (virtual address) and what goes into CR3 for it
+    pde_t *dir;
+    uint32_t dir_phys;
+
+    // Version of the kernel's directory the shared entries were last copied from
+    uint32_t kernel_gen;
+} addr_space_t;
+
+// PDE avail bit marking an entry as belonging to one address space (not copied from the kernel)
+#define PDE_AVAIL_PRIVATE ((0x2))
+
+// Point as at the kernel's directory (never freed)
+void as_init_kernel(addr_space_t *as);
+
+// A new page directory with only the kernel mappings (false if out of memory)
+bool as_create(addr_space_t *as);
+
+// Free an address space from as_create (if it's loaded, this switches to the kernel's first)
+void as_destroy(addr_space_t *as);
+
+// Load as into CR3 (skipped if it's already there)
+void as_switch(addr_space_t *as);
+
+// Is as the one in CR3 right now?
+bool as_is_current(addr_space_t *as);
+
+// Map/ unmap a huge page only in as
+// Unmapping returns the physical address that was mapped (0 if there wasn't a private huge page)
+bool as_map_huge_page(addr_space_t *as, uint32_t virt, uint32_t phys, bool user_page, bool writeable);
+uint32_t as_unmap_huge_page(addr_space_t *as, uint32_t virt);
+
+// Same for 4kb pages, in page tables that only as has (freed once they're empty, or by as_destroy)
+bool as_map_page(addr_space_t *as, uint32_t virt, uint32_t phys, bool user_page, bool writeable);
+uint32_t as_unmap_page(addr_space_t *as, uint32_t virt);
+
+// Physical address virt is mapped to in as (0 if it isn't)
+uint32_t as_virt_to_phys(addr_space_t *as, uint32_t virt);
+
+// Copy the private huge page mapped at virt in the loaded address space into as (if there is one)
+void as_inherit_huge_page(addr_space_t *as, uint32_t virt);
+
 // Maps a single huge page for the filesystem
 // @TODO: Walk the filesystem and map as many huge pages as needed
 void *map_filesys_pages(void *fs_root);
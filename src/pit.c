@@ -0,0 +1,141 @@
+#include "pit.h"
+#include "util.h"
+#include "scheduler.h"
+#include "timer.h"
+
+// Number of IRQ 0s since boot:
+volatile uint32_t pit_ticks = 0;
+
+// Currently programmed tick rate:
+static uint32_t pit_hz = 0;
+static uint32_t pit_divisor = 0;
+
+// One-shot state:
+static bool oneshot_armed = false;
+static uint32_t oneshot_counts = 0;   // Length of the stretch that is armed right now
+static uint32_t oneshot_residual = 0;
+static uint32_t oneshot_ticks_left = 0; // Ticks to the deadline, including the armed stretch
+
+static inline void _pit_program_periodic() {
+    outb(PIT_CMD, PIT_CMD_CH0_SQUARE);
+    outb(PIT_CHANNEL0, pit_divisor & 0x0FF);
+    outb(PIT_CHANNEL0, (pit_divisor >> 8) & 0x0FF);
+}
+
+uint32_t pit_set_frequency(uint32_t hz) {
+    if (hz < PIT_MIN_HZ) hz = PIT_MIN_HZ;
+    if (hz > PIT_MAX_HZ) hz = PIT_MAX_HZ;
+
+    // Counter reloads from this value and fires IRQ 0 every time it hits 0
+    uint32_t divisor = PIT_BASE_FREQ / hz;
+
+    uint32_t flags = cli_and_save();
+    pit_divisor = divisor;
+    oneshot_armed = false;
+    oneshot_residual = 0;
+    _pit_program_periodic();
+
+    // Timers were armed in ticks of the old rate:
+    timer_rescale(pit_hz, hz);
+    pit_hz = hz;
+
+    // Keep the time slice the same length in ms at the new rate:
+    scheduler_set_quantum(scheduler_get_quantum());
+    restore_flags(flags);
+
+    return pit_hz;
+}
+
+uint32_t pit_get_frequency() {
+    return pit_hz;
+}
+
+// Arm as much of the way to the deadline as the 16 bit counter can do (interrupts off)
+static void _pit_arm_oneshot() {
+    uint32_t ticks = 0xFFFF / pit_divisor;
+    if (ticks > oneshot_ticks_left) ticks = oneshot_ticks_left;
+
+    oneshot_counts = ticks * pit_divisor;
+    outb(PIT_CMD, PIT_CMD_CH0_ONESHOT);
+    outb(PIT_CHANNEL0, oneshot_counts & 0x0FF);
+    outb(PIT_CHANNEL0, (oneshot_counts >> 8) & 0x0FF);
+    oneshot_armed = true;
+}
+
+// Add counts_done to the partial tick we had, returns whole ticks (interrupts off)
+static uint32_t _pit_oneshot_ticks(uint32_t counts_done) {
+    // Keep the partial tick around so waking up early doesn't make us lose time:
+    counts_done += oneshot_residual;
+    oneshot_residual = counts_done % pit_divisor;
+    return counts_done / pit_divisor;
+}
+
+void pit_start_oneshot(uint32_t ticks) {
+    if (ticks == 0) ticks = 1;
+
+    uint32_t flags = cli_and_save();
+    oneshot_ticks_left = ticks;
+    _pit_arm_oneshot();
+    restore_flags(flags);
+}
+
+uint32_t pit_oneshot_irq() {
+    uint32_t flags = cli_and_save();
+    if (!oneshot_armed) {
+        restore_flags(flags);
+        return 0;
+    }
+
+    uint32_t ticks = _pit_oneshot_ticks(oneshot_counts);
+    if (ticks < oneshot_ticks_left) {
+        // Not there yet, go again straight away
+        oneshot_ticks_left -= ticks;
+        _pit_arm_oneshot();
+    }
+    else {
+        oneshot_ticks_left = 0;
+        oneshot_armed = false;
+        _pit_program_periodic();
+    }
+    restore_flags(flags);
+    return ticks;
+}
+
+uint32_t pit_stop_oneshot() {
+    uint32_t flags = cli_and_save();
+    if (!oneshot_armed) {
+        restore_flags(flags);
+        return 0;
+    }
+
+    // Woken early, read back how far the counter got:
+    uint32_t counts_done = oneshot_counts;
+    outb(PIT_CMD, PIT_CMD_CH0_LATCH);
+    uint32_t remaining = inb(PIT_CHANNEL0);
+    remaining |= ((uint32_t)inb(PIT_CHANNEL0)) << 8;
+    if (remaining <= oneshot_counts) {
+        counts_done = oneshot_counts - remaining;
+    }
+
+    uint32_t ticks = _pit_oneshot_ticks(counts_done);
+    oneshot_ticks_left = 0;
+    oneshot_armed = false;
+    _pit_program_periodic();
+    restore_flags(flags);
+
+    return ticks;
+}
+
+uint32_t pit_oneshot_ticks_left() {
+    return oneshot_ticks_left;
+}
+
+bool pit_in_oneshot() {
+    return oneshot_armed;
+}
+
+// Configure PIT (IRQ 0)
+void init_pit () {
+    pit_ticks = 0;
+    pit_set_frequency(PIT_DEFAULT_HZ);
+}
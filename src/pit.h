@@ -0,0 +1,93 @@
+#ifndef PIT_H
+#define PIT_H
+#include "types.h"
+
+// Intel 8253/8254 Programmable Interval Timer
+// Channel 0 is wired to IRQ 0 and drives the scheduler tick
+// See: https://wiki.osdev.org/Programmable_Interval_Timer
+
+// Frequency of the oscillator feeding the PIT (Hz)
+#define PIT_BASE_FREQ ((1193182))
+
+// IO ports:
+#define PIT_CHANNEL0 ((0x40))
+#define PIT_CHANNEL2 ((0x42))
+#define PIT_CMD ((0x43))
+
+// Channel 2 gate is bit 0 of this port, its output can be read back in bit 5
+// (Bit 1 connects it to the PC speaker, keep that off)
+#define PIT_CH2_GATE_PORT ((0x61))
+#define PIT_CH2_GATE ((0x01))
+#define PIT_CH2_SPEAKER ((0x02))
+#define PIT_CH2_OUT ((0x20))
+
+// Channel 0, access lobyte/ hibyte, mode 3 (square wave), binary counting
+#define PIT_CMD_CH0_SQUARE ((0x36))
+
+// Channel 0, access lobyte/ hibyte, mode 0 (interrupt on terminal count), binary counting
+#define PIT_CMD_CH0_ONESHOT ((0x30))
+
+// Channel 0, latch the current count so it can be read back
+#define PIT_CMD_CH0_LATCH ((0x00))
+
+// Channel 2, access lobyte/ hibyte, mode 0, binary counting
+#define PIT_CMD_CH2_ONESHOT ((0xB0))
+
+// Tick rates we allow the PIT to be programmed to (Hz):
+#define PIT_MIN_HZ ((100))
+#define PIT_MAX_HZ ((1000))
+#define PIT_DEFAULT_HZ ((250))
+
+// Configure PIT (IRQ 0) to tick at PIT_DEFAULT_HZ
+void init_pit(void);
+
+/*
+ * pit_set_frequency
+ *
+ * Reprogram channel 0 to fire hz times a second.
+ * hz is clamped to [PIT_MIN_HZ, PIT_MAX_HZ].
+ * Also rescales the scheduler time slice and pending timers so they stay the same length in ms.
+ *
+ * Returns the frequency that was actually programmed.
+ */
+uint32_t pit_set_frequency(uint32_t hz);
+
+// Current tick rate in Hz
+uint32_t pit_get_frequency(void);
+
+/*
+ * pit_start_oneshot
+ *
+ * Stop ticking and instead fire IRQ 0 once ticks ticks from now. Used by the idle process to
+ * sleep until the next timer. The 16 bit counter can only count to ~55ms, so longer sleeps are
+ * done as a chain of one-shots: each IRQ 0 on the way calls pit_oneshot_irq, which arms the next one.
+ */
+void pit_start_oneshot(uint32_t ticks);
+
+/*
+ * pit_oneshot_irq
+ *
+ * IRQ 0 went off while a one-shot was armed. Returns how many whole ticks that stood for.
+ * If the deadline from pit_start_oneshot is still ahead the next one-shot is armed (pit_in_oneshot stays true),
+ * otherwise the PIT goes back to ticking periodically.
+ */
+uint32_t pit_oneshot_irq(void);
+
+/*
+ * pit_stop_oneshot
+ *
+ * Woken up by something else before the deadline: go back to ticking periodically.
+ * Returns how many whole ticks passed while in one-shot mode (leftover counts carry over to the next one-shot).
+ */
+uint32_t pit_stop_oneshot(void);
+
+// Ticks left until the deadline of the one-shot (0 if none is armed)
+uint32_t pit_oneshot_ticks_left(void);
+
+// Is a one-shot armed?
+bool pit_in_oneshot(void);
+
+// Number of IRQ 0s since boot:
+extern volatile uint32_t pit_ticks;
+
+#endif
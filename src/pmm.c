@@ -0,0 +1,289 @@
+#include "pmm.h"
+#include "zpool.h"
+#include "exec_cache.h"
+#include "util.h"
+#include "x86_stuff.h"
+#include "paging.h"
+
+// Free block bitmaps, one bit per block (set = free, and not part of a bigger free block)
+// Order k has PMM_NUM_FRAMES >> k bits, starting at word pmm_order_base[k]
+#define PMM_ORDER_WORDS(order) (((PMM_NUM_FRAMES >> (order)) / 32))
+#define PMM_BITMAP_WORDS ((2 * PMM_NUM_FRAMES / 32))
+static uint32_t pmm_bitmap[PMM_BITMAP_WORDS];
+static uint32_t pmm_order_base[PMM_MAX_ORDER + 1];
+
+// Free blocks of each order, and the lowest bitmap word that could have one
+static uint32_t pmm_num_free[PMM_MAX_ORDER + 1];
+static uint32_t pmm_hint[PMM_MAX_ORDER + 1];
+
+// Stats (in 4kb frames, except pmm_top):
+static uint32_t pmm_total_frames = 0; // Usable RAM according to the memory map
+static uint32_t pmm_free_frames = 0;
+static uint32_t pmm_boot_free_frames = 0; // Free right after init_pmm (the rest was reserved)
+static uint32_t pmm_top = 0; // End of the highest usable region
+static uint32_t pmm_shared_frames = 0; // Frames with more than one owner
+
+// Owners of each 4kb frame past the first (see pmm_page_share)
+#define PMM_MAX_PAGE_REFS ((0xFF))
+static uint8_t pmm_page_refs[PMM_NUM_FRAMES];
+
+// Ranges (physical, [start, end)) that are never given out:
+#define PMM_MAX_RESERVED ((16))
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} pmm_range_t;
+static pmm_range_t pmm_reserved[PMM_MAX_RESERVED];
+static uint32_t pmm_num_reserved = 0;
+
+// kernel.c identity maps this much at the framebuffer
+#define PMM_FRAMEBUFFER_SIZE ((2 * HUGE_PAGE_SIZE))
+
+static inline bool _pmm_test(uint32_t order, uint32_t idx) {
+    return (pmm_bitmap[pmm_order_base[order] + idx / 32] >> (idx % 32)) & 0x01;
+}
+
+static inline void _pmm_set(uint32_t order, uint32_t idx) {
+    pmm_bitmap[pmm_order_base[order] + idx / 32] |= (1U << (idx % 32));
+    pmm_num_free[order]++;
+    if (idx / 32 < pmm_hint[order]) pmm_hint[order] = idx / 32;
+}
+
+static inline void _pmm_clear(uint32_t order, uint32_t idx) {
+    pmm_bitmap[pmm_order_base[order] + idx / 32] &= ~(1U << (idx % 32));
+    pmm_num_free[order]--;
+}
+
+// Index of a free block of exactly this order (-1 if there aren't any)
+static int32_t _pmm_find(uint32_t order) {
+    if (0 == pmm_num_free[order]) return -1;
+
+    uint32_t *map = &pmm_bitmap[pmm_order_base[order]];
+    uint32_t num_words = PMM_ORDER_WORDS(order);
+    uint32_t w;
+    for (w = pmm_hint[order]; w < num_words; w++) {
+        if (map[w]) {
+            pmm_hint[order] = w;
+            return w * 32 + __builtin_ctz(map[w]);
+        }
+    }
+    return -1;
+}
+
+void *pmm_alloc(uint32_t order) {
+    void *phys = pmm_alloc_noreclaim(order);
+    if (phys) return phys;
+
+    // Out of memory: give back the pages we only keep around for later, and try again
+    if (zpool_drain()) {
+        phys = pmm_alloc_noreclaim(order);
+        if (phys) return phys;
+    }
+
+    // Still out, drop binaries no one is running one at a time (least recently used first)
+    while (exec_cache_reclaim()) {
+        phys = pmm_alloc_noreclaim(order);
+        if (phys) return phys;
+    }
+    return NULL;
+}
+
+void *pmm_alloc_noreclaim(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return NULL;
+    uint32_t flags = cli_and_save();
+
+    // Smallest free block that's big enough:
+    uint32_t k;
+    int32_t idx = -1;
+    for (k = order; k <= PMM_MAX_ORDER; k++) {
+        idx = _pmm_find(k);
+        if (idx >= 0) break;
+    }
+    if (idx < 0) {
+        restore_flags(flags);
+        return NULL;
+    }
+    _pmm_clear(k, idx);
+
+    // Split it in half until it's the right size, the upper halves stay free
+    while (k > order) {
+        k--;
+        idx *= 2;
+        _pmm_set(k, idx + 1);
+    }
+
+    pmm_free_frames -= (1 << order);
+    restore_flags(flags);
+    return (void *)((uint32_t)idx << (order + 12));
+}
+
+void pmm_free(void *phys, uint32_t order) {
+    uint32_t addr = (uint32_t)phys;
+    if (!phys || order > PMM_MAX_ORDER || addr >= PMM_MAX_PHYS) return;
+    if (addr & ((PAGE_SIZE << order) - 1)) return;
+    uint32_t flags = cli_and_save();
+
+    // Someone else still owns it, just drop this reference
+    if (0 == order && pmm_page_refs[addr / PAGE_SIZE]) {
+        if (0 == --pmm_page_refs[addr / PAGE_SIZE]) pmm_shared_frames--;
+        restore_flags(flags);
+        return;
+    }
+
+    uint32_t idx = addr >> (order + 12);
+    if (_pmm_test(order, idx)) {
+        // Already free
+        restore_flags(flags);
+        return;
+    }
+    pmm_free_frames += (1 << order);
+
+    // Merge with our buddy for as long as it's free too:
+    while (order < PMM_MAX_ORDER && _pmm_test(order, idx ^ 1)) {
+        _pmm_clear(order, idx ^ 1);
+        idx >>= 1;
+        order++;
+    }
+    _pmm_set(order, idx);
+
+    restore_flags(flags);
+}
+
+bool pmm_page_share(uint32_t phys) {
+    if (phys >= PMM_MAX_PHYS) return false;
+    uint32_t flags = cli_and_save();
+    uint8_t *refs = &pmm_page_refs[phys / PAGE_SIZE];
+    if (*refs == PMM_MAX_PAGE_REFS) {
+        restore_flags(flags);
+        return false;
+    }
+    if (0 == (*refs)++) pmm_shared_frames++;
+    restore_flags(flags);
+    return true;
+}
+
+bool pmm_page_is_shared(uint32_t phys) {
+    if (phys >= PMM_MAX_PHYS) return false;
+    return pmm_page_refs[phys / PAGE_SIZE] != 0;
+}
+
+uint32_t pmm_free_bytes() {
+    return pmm_free_frames * PAGE_SIZE;
+}
+
+static void _pmm_reserve(uint32_t start, uint32_t end) {
+    if (pmm_num_reserved >= PMM_MAX_RESERVED) return;
+    pmm_reserved[pmm_num_reserved].start = PAGE_ALIGN(start);
+    pmm_reserved[pmm_num_reserved].end = PAGE_ALIGN((end + PAGE_SIZE - 1));
+    pmm_num_reserved++;
+}
+
+// Free [start, end) in the biggest aligned blocks that fit
+static void _pmm_free_range(uint32_t start, uint32_t end) {
+    while (start < end) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 && ((start & ((PAGE_SIZE << order) - 1)) || (end - start) < (PAGE_SIZE << order))) {
+            order--;
+        }
+        pmm_free((void *)start, order);
+        start += (PAGE_SIZE << order);
+    }
+}
+
+// Free [start, end) minus any reserved ranges (from first_reserved on) that overlap it
+static void _pmm_add_range(uint32_t start, uint32_t end, uint32_t first_reserved) {
+    uint32_t i;
+    for (i = first_reserved; i < pmm_num_reserved; i++) {
+        pmm_range_t *r = &pmm_reserved[i];
+        if (r->start < end && r->end > start) {
+            if (start < r->start) _pmm_add_range(start, r->start, i + 1);
+            if (r->end < end) _pmm_add_range(r->end, end, i + 1);
+            return;
+        }
+    }
+    _pmm_free_range(start, end);
+}
+
+// Add a usable region from the memory map
+static void _pmm_add_region(uint64_t base, uint64_t length) {
+    if (base >= PMM_MAX_PHYS) return;
+    uint64_t end = base + length;
+    if (end > PMM_MAX_PHYS) end = PMM_MAX_PHYS;
+
+    uint32_t start = PAGE_ALIGN(((uint32_t)base + PAGE_SIZE - 1));
+    uint32_t stop = PAGE_ALIGN(((uint32_t)end));
+    if (start >= stop) return;
+
+    pmm_total_frames += (stop - start) / PAGE_SIZE;
+    if (stop > pmm_top) pmm_top = stop;
+    _pmm_add_range(start, stop, 0);
+}
+
+void init_pmm(multiboot_t *boot_info) {
+    uint32_t i, base = 0;
+    for (i = 0; i <= PMM_MAX_ORDER; i++) {
+        pmm_order_base[i] = base;
+        base += PMM_ORDER_WORDS(i);
+        pmm_num_free[i] = 0;
+        pmm_hint[i] = 0;
+    }
+    if (!boot_info) return;
+
+    // BIOS data, the multiboot info, and the VGA page live down here:
+    _pmm_reserve(0, 0x100000);
+
+    // The whole kernel huge page (the kernel stack is at the top of it):
+    _pmm_reserve((uint32_t)&kernel_slide, (uint32_t)&kernel_slide + HUGE_PAGE_SIZE);
+
+    // Modules (the filesystem):
+    if (boot_info->flags & MULTIBOOT_INFO_MODS) {
+        multiboot_module_t *mods = (multiboot_module_t *)boot_info->mods_addr;
+        for (i = 0; i < boot_info->mods_count; i++) {
+            _pmm_reserve(mods[i].mod_start, mods[i].mod_end);
+        }
+    }
+
+    // Framebuffer, if it happens to be in RAM:
+    if (boot_info->flags & MULTIBOOT_INFO_FRAMEBUFFER_INFO) {
+        if (boot_info->framebuffer_addr < PMM_MAX_PHYS) {
+            uint32_t fb = (uint32_t)boot_info->framebuffer_addr;
+            _pmm_reserve(fb, fb + PMM_FRAMEBUFFER_SIZE);
+        }
+    }
+
+    if (boot_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t cursor = boot_info->mmap_addr;
+        while (cursor < boot_info->mmap_addr + boot_info->mmap_length) {
+            multiboot_mmap_entry_t *entry = (multiboot_mmap_entry_t *)cursor;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+                _pmm_add_region(entry->base_addr, entry->length);
+            }
+            cursor += entry->size + sizeof(entry->size);
+        }
+    }
+    else if (boot_info->flags & MULTIBOOT_INFO_MEMORY) {
+        // No memory map, all we know is how much there is after 1MB (mem_upper is in kb)
+        _pmm_add_region(0x100000, (uint64_t)boot_info->mem_upper * 1024);
+    }
+
+    pmm_boot_free_frames = pmm_free_frames;
+}
+
+size_t pmm_report(char *buf, size_t size) {
+    size_t bytes_read = 0;
+    char linebuf[128];
+
+    snprintf(linebuf, sizeof(linebuf), "MemTotal: %u kB\nMemFree: %u kB\nReserved: %u kB\nShared: %u kB\nTop: %x\n",
+        pmm_total_frames * (PAGE_SIZE / 1024), pmm_free_frames * (PAGE_SIZE / 1024),
+        (pmm_total_frames - pmm_boot_free_frames) * (PAGE_SIZE / 1024), pmm_shared_frames * (PAGE_SIZE / 1024), pmm_top);
+    bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+
+    // Free blocks of each size, 4kb up to 4MB:
+    uint32_t i;
+    for (i = 0; i <= PMM_MAX_ORDER; i++) {
+        snprintf(linebuf, sizeof(linebuf), "Free %u kB blocks: %u\n", (PAGE_SIZE / 1024) << i, pmm_num_free[i]);
+        bytes_read += strncpy(buf + bytes_read, linebuf, size - bytes_read);
+    }
+
+    return bytes_read;
+}
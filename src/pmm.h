@@ -0,0 +1,58 @@
+#ifndef PMM_H
+#define PMM_H
+#include "types.h"
+#include "defines.h"
+#include "multiboot.h"
+
+// Physical memory manager
+// Hands out physical memory in blocks of 4kb << order (order 0 = 4kb up to order 10 = 4MB huge page)
+// with a buddy allocator. Only RAM the multiboot memory map says is usable is ever given out,
+// minus the kernel, the boot modules (filesystem) and the framebuffer.
+// The free blocks of each order are tracked in a bitmap, none of the metadata lives in the
+// physical memory itself (so nothing has to be mapped to allocate or free it).
+
+#define PMM_MAX_ORDER ((10))
+#define PMM_HUGE_ORDER ((PMM_MAX_ORDER))
+
+// Physical memory past this isn't used
+#define PMM_MAX_PHYS ((0x40000000))
+#define PMM_NUM_FRAMES ((PMM_MAX_PHYS / PAGE_SIZE))
+
+/*
+ * init_pmm
+ *
+ * Read the memory map out of the multiboot info and free everything usable.
+ * Has to run before paging is on (the multiboot info is in low memory, which isn't mapped after).
+ */
+void init_pmm(multiboot_t *boot_info);
+
+/*
+ * pmm_alloc
+ *
+ * Allocate 4kb << order bytes of physical memory, aligned to their size (NULL if there isn't any).
+ * If we're out, memory that's only being held on to for later (the zeroed page pools, then cached
+ * binaries no one is running) is given back first.
+ */
+void *pmm_alloc(uint32_t order);
+
+// Same, but never reclaims anything (for the ones being reclaimed from, so they don't feed on each other)
+void *pmm_alloc_noreclaim(uint32_t order);
+
+// Free a block from pmm_alloc (order has to match)
+// A shared 4kb frame only loses one owner, it's freed with the last one
+void pmm_free(void *phys, uint32_t order);
+
+// Give a 4kb frame another owner (fork), each one frees it once
+// Returns false if it already has as many as we can count
+bool pmm_page_share(uint32_t phys);
+
+// Does a 4kb frame have more than one owner?
+bool pmm_page_is_shared(uint32_t phys);
+
+// Free bytes of physical memory
+uint32_t pmm_free_bytes(void);
+
+// Memory stats (for /proc/meminfo), returns bytes written
+size_t pmm_report(char *buf, size_t size);
+
+#endif
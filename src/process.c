@@ -7,52 +7,156 @@
 #include "stdio.h"
 #include "scheduler.h"
 #include "sandbox.h"
+#include "elf.h"
+#include "exec_cache.h"
+#include "syscall.h"
 
-pcb_t processes[MAX_PROCESSES];
+#include "slab.h"
 
-#define USER_STACK_OFFSET ((0x200000))
+// Leave at least this much room for the user stack below USER_STACK_TOP
+#define USER_STACK_MIN_SIZE ((0x10000))
+
+// ELF segments have to be loaded somewhere in [PROC_VIRT_ADDR, USER_IMAGE_END)
+#define USER_IMAGE_END ((USER_STACK_TOP - USER_STACK_MIN_SIZE))
 
 // Current process running
 pcb_t *current_proc;
 
-// Mark all pcbs as free
+// PCBs and kernel stacks come from their own slab caches:
+static slab_cache_t pcb_cache;
+static slab_cache_t kstack_cache;
+
+// PIDs: a bit per PID (set = taken) and a table of who has it
+#define PID_BITMAP_WORDS ((MAX_PROCESSES / 32))
+static uint32_t pid_bitmap[PID_BITMAP_WORDS];
+static pcb_t *pid_table[MAX_PROCESSES];
+
+// Destroyed PCBs that still need to be freed (linked through run_next)
+// A process is destroyed while it's still running on its kernel stack (see sysret),
+// so the stack can't go back to the cache until someone else is running.
+static pcb_t *reap_list = NULL;
+
+// Setup the PCB/ kernel stack caches and mark every PID as free
 void setup_pcb_table() {
     uint32_t i = 0;
+    slab_cache_init(&pcb_cache, "pcb", sizeof(pcb_t), 16);
+    slab_cache_init(&kstack_cache, "kstack", KERNEL_STACK_SIZE, 16);
+    for (i = 0; i < PID_BITMAP_WORDS; i++) {
+        pid_bitmap[i] = 0;
+    }
     for (i = 0; i < MAX_PROCESSES; i++) {
-        processes[i].in_use = false;
+        pid_table[i] = NULL;
     }
+    reap_list = NULL;
     current_proc = NULL;
 }
 
+// Find the lowest free PID and take it, -1 if there aren't any
+static int32_t _pid_alloc() {
+    uint32_t i;
+    for (i = 0; i < PID_BITMAP_WORDS; i++) {
+        if (pid_bitmap[i] != 0xFFFFFFFF) {
+            uint32_t bit = __builtin_ctz(~pid_bitmap[i]);
+            pid_bitmap[i] |= (1 << bit);
+            return (i * 32) + bit;
+        }
+    }
+    return -1;
+}
+
+static inline void _pid_free(uint32_t pid) {
+    pid_bitmap[pid / 32] &= ~(1 << (pid % 32));
+    pid_table[pid] = NULL;
+}
+
+pcb_t *pid_to_pcb(uint32_t pid) {
+    if (pid >= MAX_PROCESSES) return NULL;
+    return pid_table[pid];
+}
+
+pcb_t *process_next(uint32_t *pid) {
+    uint32_t cur = *pid;
+    while (cur < MAX_PROCESSES) {
+        // Ignore PIDs below cur in this word:
+        uint32_t word = pid_bitmap[cur / 32] & (0xFFFFFFFF << (cur % 32));
+        if (word != 0) {
+            *pid = (cur & ~31) + __builtin_ctz(word);
+            return pid_table[*pid];
+        }
+        cur = (cur & ~31) + 32;
+    }
+    return NULL;
+}
+
+// Free everything on the reap list
+static void _reap_pcbs() {
+    while (NULL != reap_list) {
+        pcb_t *dead = reap_list;
+        reap_list = dead->run_next;
+        slab_free(&kstack_cache, dead->kern_stack);
+        slab_free(&pcb_cache, dead);
+    }
+}
+
 // Setup a PCB
 pcb_t *alloc_pcb() {
     uint32_t i;
     uint32_t flags = cli_and_save();
-    pcb_t *new_pcb = NULL;
 
-    for (i = 0; i < MAX_PROCESSES; i++) {
-        if (!processes[i].in_use) {
-            processes[i].in_use = true;
-            new_pcb = &(processes[i]);
-            break;
-        }
+    // We're on a live process's stack, so it's safe to free dead ones now
+    _reap_pcbs();
+
+    int32_t pid = _pid_alloc();
+    if (pid < 0) {
+        restore_flags(flags);
+        return NULL;
     }
 
-    if (!new_pcb) return NULL;
+    pcb_t *new_pcb = slab_alloc(&pcb_cache);
+    uint8_t *kern_stack = slab_alloc(&kstack_cache);
+    if (!new_pcb || !kern_stack) {
+        slab_free(&pcb_cache, new_pcb);
+        slab_free(&kstack_cache, kern_stack);
+        _pid_free(pid);
+        restore_flags(flags);
+        return NULL;
+    }
+
+    new_pcb->pid = pid;
+    new_pcb->kern_stack = kern_stack;
+    new_pcb->in_use = true;
+    pid_table[pid] = new_pcb;
 
     new_pcb->ksp = 0;
     new_pcb->kbp = 0;
     new_pcb->parent_ksp = 0;
     new_pcb->parent_kbp = 0;
-    new_pcb->phys_addr = NULL;
-    new_pcb->mmap_phys_addr = NULL;
+    new_pcb->exe = NULL;
+    new_pcb->image.num_segments = 0;
+    new_pcb->vmas = NULL;
+    new_pcb->brk = USER_HEAP_START;
+    new_pcb->faults_file = 0;
+    new_pcb->faults_zero = 0;
+    new_pcb->faults_shared = 0;
+    new_pcb->faults_cow = 0;
+    new_pcb->fault_ns = 0;
+    as_init_kernel(&new_pcb->as);
     new_pcb->uid = 0;
     new_pcb->kern_proc = false;
     new_pcb->blocking_execute = false;
     new_pcb->nonblocking = false;
     new_pcb->sleeping = false;
-    new_pcb->num_ticks_remaining = 0;
+    new_pcb->sleep_timer.pending = false;
+    new_pcb->slice_ticks_left = sched_slice_ticks;
+    new_pcb->run_next = NULL;
+    new_pcb->run_prev = NULL;
+    new_pcb->on_runq = false;
+    new_pcb->priority = 0;
+    new_pcb->waiting_io = false;
+    new_pcb->wait_flag = NULL;
+    new_pcb->wait_next = NULL;
     new_pcb->should_die = false;
+    fpu_init_process(new_pcb);
     new_pcb->set_uid_enabled = false;
     new_pcb->set_uid_blocking = false;
     new_pcb->set_uid_val = 0;
@@ -74,9 +178,73 @@ void _process_setup_stdio (pcb_t *new_pcb) {
     new_pcb->fds[0].mount->ops.open(&new_pcb->fds[0], STDIO_MOUNT);
 }
 
+// Areas for the ELF segments and the stack of pcb->exe
+// Read only segments use the pages shared by everyone running this binary, the ones someone already
+// read in are mapped right away. Everything else is filled in on its first touch (see vma_fault)
+static bool _process_map_image(pcb_t *pcb) {
+    elf_image_t *image = &pcb->exe->image;
+    uint32_t mapped_end = 0;
+    uint32_t i;
+
+    for (i = 0; i < image->num_segments; i++) {
+        elf_segment_t *seg = &image->segments[i];
+        uint32_t start = PAGE_ALIGN(seg->vaddr);
+        uint32_t end = PAGE_ALIGN((seg->vaddr + seg->memsz + PAGE_SIZE - 1));
+        uint32_t flags = VMA_READ | VMA_FILE | ((seg->flags & PF_W) ? VMA_WRITE : VMA_SHARED);
+
+        if (start < mapped_end) {
+            // Shares its first page with the last segment, which has to allow both (so it can't be shared with other processes)
+            vma_t *prev = vma_find(pcb->vmas, start);
+            if (prev && ((flags ^ prev->flags) & VMA_WRITE)) {
+                uint32_t both = (prev->flags | flags) & ~VMA_SHARED;
+                if (0 != vma_unmap(&pcb->as, &pcb->vmas, start, mapped_end - start)) return false;
+                if (0 != vma_map_file(&pcb->vmas, start, mapped_end - start, both, pcb->exe)) return false;
+            }
+            start = mapped_end;
+        }
+
+        if (start < end) {
+            if (0 != vma_map_file(&pcb->vmas, start, end - start, flags, pcb->exe)) return false;
+            mapped_end = end;
+        }
+    }
+
+    // Anything already in memory doesn't need to fault (or be read again):
+    vma_t *vma;
+    for (vma = pcb->vmas; vma; vma = vma->next) {
+        if (!(vma->flags & VMA_SHARED)) continue;
+
+        uint32_t page;
+        for (page = vma->start; page < vma->end; page += PAGE_SIZE) {
+            uint32_t shared = exec_image_resident_page(pcb->exe, page);
+            if (shared) as_map_page(&pcb->as, page, shared, true, false);
+        }
+    }
+
+    // Everything between the image and the top of the stack is stack:
+    return 0 == vma_map(&pcb->vmas, image->end, USER_STACK_TOP - image->end, VMA_READ | VMA_WRITE);
+}
+
+#ifdef UIUCTF
+// Back the whole image/ stack huge page with whatever huge page we get, as is (not zeroed)
+static bool _process_map_stale_page(addr_space_t *as, vma_t **vmas) {
+    void *huge_page = alloc_huge_page();
+    if (!huge_page) return false;
+
+    if (0 != vma_map(vmas, DIR_ALIGN(PROC_VIRT_ADDR), HUGE_PAGE_SIZE, VMA_READ | VMA_WRITE | VMA_HUGE)) {
+        free_huge_page(huge_page);
+        return false;
+    }
+    as_map_huge_page(as, PROC_VIRT_ADDR, (uint32_t)huge_page, true, true);
+    return true;
+}
+#endif
+
 // Setup a user PCB
 pcb_t *_process_create_user (char *filename, uid_t uid) {
-    void *huge_page = NULL;
+    addr_space_t as;
+    vma_t *vmas = NULL;
+    bool stale_image = false;
 
     // Locate file and read it
     // @TODO: Use open(), read() abstractions
@@ -86,28 +254,33 @@ pcb_t *_process_create_user (char *filename, uid_t uid) {
     xentry *found_entry = filesys_lookup(filename);
     if (!found_entry) return NULL;
 
-    // Try to allocate a huge page:
-    huge_page = alloc_huge_page();
-    if (!huge_page) return NULL; // ENOMEM
-
-    // Map this huge page & read into it:
-    map_huge_page(PROC_VIRT_ADDR, (uint32_t)huge_page, true, true);
+    // New address space for it:
+    if (!as_create(&as)) return NULL;
+    as_switch(&as);
 
-    // Just 0 out the first address, in case the file we are reading is empty
-    // If it is empty, and this page used to be an ELF, then we will be executing that code
-    #ifndef UIUCTF
-    *(uint32_t *)PROC_VIRT_ADDR = 0;
-    #endif
-
-    filesys_read_bytes(found_entry, 0, (int8_t*)PROC_VIRT_ADDR, (1 << 22));
-
-    // Check the file we are opening to see if its actually an ELF file:
-    if (((*(uint32_t *)PROC_VIRT_ADDR) & 0xFFFFFF00) != (ELF_MAGIC & 0xFFFFFF00)) {
+    elf_image_t image;
+    exec_image_t *exe = exec_image_get(found_entry, PROC_VIRT_ADDR, USER_IMAGE_END);
+    if (exe) {
+        image = exe->image;
+    }
+    else {
+        #ifdef UIUCTF
+        // If the file is empty, and this page used to be an ELF, then we will be executing that code
+        int8_t probe;
+        if (0 != filesys_read_bytes(found_entry, 0, &probe, 1)) goto PROCESS_CREATE_CLEANUP;
+        if (!_process_map_stale_page(&as, &vmas)) goto PROCESS_CREATE_CLEANUP;
+        if (!elf_check_header((Elf32_Ehdr *)PROC_VIRT_ADDR)) goto PROCESS_CREATE_CLEANUP;
+        image.entry = ((Elf32_Ehdr *)PROC_VIRT_ADDR)->e_entry;
+        image.special_mode = ((Elf32_Ehdr *)PROC_VIRT_ADDR)->e_ident[0];
+        image.num_segments = 0;
+        stale_image = true;
+        #else
         goto PROCESS_CREATE_CLEANUP;
+        #endif
     }
 
     // Read ELF permissions bit:
-    char elf_special_mode = *(uint32_t *)PROC_VIRT_ADDR & 0x0FF;
+    char elf_special_mode = image.special_mode;
 
     // Setup PCB:
     pcb_t *new_pcb = alloc_pcb();
@@ -115,7 +288,15 @@ pcb_t *_process_create_user (char *filename, uid_t uid) {
         goto PROCESS_CREATE_CLEANUP;
     }
 
-    new_pcb->phys_addr = huge_page;
+    new_pcb->as = as;
+    new_pcb->vmas = vmas;
+    new_pcb->image = image;
+    new_pcb->exe = exe;
+    if (!stale_image && !_process_map_image(new_pcb)) {
+        process_destroy(new_pcb);
+        if (current_proc) as_switch(&current_proc->as);
+        return NULL;
+    }
 
     // Setup standard io
     _process_setup_stdio(new_pcb);
@@ -140,14 +321,18 @@ pcb_t *_process_create_user (char *filename, uid_t uid) {
     return new_pcb;
 
 PROCESS_CREATE_CLEANUP:
-    // If something failed, free huge page
-    free_huge_page(huge_page);
+    // If something failed, put the caller's pages back and free ours
+    vma_destroy_all(&as, &vmas);
+    if (current_proc) as_switch(&current_proc->as);
+    as_destroy(&as);
+    exec_image_put(exe);
     return NULL;
 }
 
 // Setup a kernel PCB
 pcb_t *_process_create_kern(uid_t uid) {
     pcb_t *new_pcb = alloc_pcb();
+    if (!new_pcb) return NULL;
     new_pcb->kern_proc = true;
     new_pcb->uid = uid;
 
@@ -168,10 +353,9 @@ pcb_t *_process_create_kern(uid_t uid) {
  * kernel_proc- When true, we setup the PCB to be a kernel PCB
  *
  * For user processes:
- * Sets up a new PCB, loads ELF into memory, and updates page mappings accordingly.
+ * Sets up a new PCB and address space, and loads the ELF into it.
  * Can fail because filename doesn't exist, isn't an ELF, or no more PCBs free
- * WARNING: Even if this fails, the page table mappings will remain modified!
- * @TODO: Make this clean page tables up
+ * On success the new address space is left loaded, on failure the caller's is put back.
  *
  * For kernel processes:
  * Allocates a new PCB with no file descriptors and marks it as a kernel process.
@@ -225,26 +409,23 @@ void process_switch (pcb_t *process) {
     // Set stack frame for future syscalls:
     tss.esp0 = (uint32_t)&process->kern_stack[KERNEL_STACK_SIZE-1];
 
-    // Setup pages:
-    map_huge_page(PROC_VIRT_ADDR, (uint32_t)process->phys_addr, true, true);
-
-    if (process->mmap_phys_addr) {
-        map_huge_page_user(MMAP_VIRT_ADDR, (uint32_t)process->mmap_phys_addr);
-    }
-    else {
-        #ifdef UIUCTF
-        // If we are the sandbox user, don't unmap any existing mmapp'ed pages
-        if (process->uid != SANDBOX_USER) {
-            unmap_huge_page(MMAP_VIRT_ADDR);
-        }
-        #else
-        unmap_huge_page(MMAP_VIRT_ADDR);
-        #endif
+    #ifdef UIUCTF
+    // If we are the sandbox user, don't unmap any existing mmapp'ed pages
+    // (whatever the last process had mapped there comes along with us)
+    if (!vma_find(process->vmas, MMAP_VIRT_ADDR) && process->uid == SANDBOX_USER) {
+        as_inherit_huge_page(&process->as, MMAP_VIRT_ADDR);
     }
+    #endif
+
+    // Setup pages (every mapping is already in its page directory, this is at most a CR3 write):
+    as_switch(&process->as);
 
     // Mark this process as the active one:
     current_proc = process;
 
+    // Trap its first FPU instruction unless the FPU still has its registers:
+    fpu_switch(process);
+
     // @TODO: Switch typeables?
 }
 
@@ -270,6 +451,10 @@ uint32_t process_launch(pcb_t *process, void *code_addr, void *stack_addr, pcb_t
         : "=r"(process->parent_ksp), "=r"(process->parent_kbp)
     );
 
+    // The new process is scheduable from here on
+    // (execute already made it current_proc, so a tick saves its KSP before anyone could pick it)
+    sched_update(process);
+
     if (parent != NULL) {
         // KSP is only read by scheduler_pass
         // For nonblocking processes, this KSP needs to point to this method
@@ -283,6 +468,7 @@ uint32_t process_launch(pcb_t *process, void *code_addr, void *stack_addr, pcb_t
 
         // If child is nonblocking, then this isn't a blocking execute
         parent->blocking_execute = !nonblocking;
+        sched_update(parent);
     }
 
     // Configure process settings per the launch request:
@@ -307,20 +493,32 @@ uint32_t process_launch(pcb_t *process, void *code_addr, void *stack_addr, pcb_t
 // This is called by sysret
 void process_destroy(pcb_t *process) {
     if (!process) return;
+    if (!process->in_use) return;
+    uint32_t flags = cli_and_save();
 
-    // Free the huge page associated with this process:
-    if (process->phys_addr) {
-        free_huge_page(process->phys_addr);
-    }
-    if (process->mmap_phys_addr) {
-        free_huge_page(process->mmap_phys_addr);
-    }
+    // Free all of its memory, then get rid of the page directory (if it's loaded, we go back to the kernel's):
+    vma_destroy_all(&process->as, &process->vmas);
+    as_destroy(&process->as);
+    exec_image_put(process->exe);
+    process->exe = NULL;
+
+    // Don't let a timer go off (or the FPU get saved) into a PCB that may be reused
+    fpu_release(process);
+    timer_cancel(&process->sleep_timer);
+    process->sleeping = false;
 
     process->in_use = false;
+    sched_update(process);
+
+    // Give back the PID now, the memory once we're off this stack:
+    _pid_free(process->pid);
+    process->run_next = reap_list;
+    reap_list = process;
 
     if (current_proc == process) {
         current_proc = NULL;
     }
+    restore_flags(flags);
 }
 
 /*
@@ -428,19 +626,15 @@ uint32_t sysret(uint32_t retval) {
     uint32_t ret_kbp = current_proc->parent_kbp;
     bool was_nonblocking = current_proc->nonblocking;
 
-    if (current_proc->mmap_phys_addr) {
-        unmap_huge_page(MMAP_VIRT_ADDR);
-    }
-
-    // After this, current_proc is NULL!
+    // After this, current_proc is NULL! (and we are on the kernel's page directory)
     process_destroy(current_proc);
 
     // If this was a nonblocking process, don't worry about returning back to process_launch context
     if (was_nonblocking) {
         // After calling this, we will never be rescheduled:
+        // (If we were the last process, the idle process takes over)
         scheduler_pass();
 
-        // If we got here, we were the last process
         // End of the line, folks
         asm volatile ("hlt");
     }
@@ -501,11 +695,10 @@ uint32_t execute(char *fname, uid_t user_id, bool nonblocking, bool kernel_proc,
         // Call the process:
         if (!kernel_proc) {
             // Launch user process:
-            // First, read the entrypoint (need to map pages to do this)
             // Map pages using a technically redundant process_switch
             process_switch(new_proc);
-            void *code_addr = (int8_t*)((uint32_t *)PROC_VIRT_ADDR)[6];
-            void *stack_addr = ((int8_t*)(PROC_VIRT_ADDR + USER_STACK_OFFSET));
+            void *code_addr = (int8_t*)new_proc->image.entry;
+            void *stack_addr = ((int8_t*)USER_STACK_TOP);
 
             // Launch user process:
             retcode = process_launch(new_proc, code_addr, stack_addr, our_proc, nonblocking, false);
@@ -523,6 +716,7 @@ uint32_t execute(char *fname, uid_t user_id, bool nonblocking, bool kernel_proc,
         if (NULL != our_proc) {
             // Mark ourselves as scheduable again:
             our_proc->blocking_execute = false;
+            sched_update(our_proc);
 
             // Fix cosmetic styling (in case we crossed a user/ superuser boundary)
             if (!our_proc->kern_proc) {
@@ -543,20 +737,123 @@ uint32_t execute(char *fname, uid_t user_id, bool nonblocking, bool kernel_proc,
 /*
  * mmap
  *
- * Request another page of memory to do whatever with.
+ * Request len bytes of (demand zeroed) memory with protections prot (VMA_READ/ VMA_WRITE), somewhere
+ * in the mmap area. addr_hint is used if it's free, otherwise we take the lowest gap that fits.
+ * Multiples of 4MB get huge pages (and a 4MB aligned address), anything else is rounded up to 4kb pages.
+ *
+ * len = 0 is the original interface: a single writeable huge page at MMAP_VIRT_ADDR, once per process.
+ * This returns the virtual address of the new memory (or 0 if unsuccessful).
+ */
+uint32_t sys_mmap (uint32_t addr_hint, uint32_t len, uint32_t prot) {
+    if (!current_proc || current_proc->kern_proc) return NULL;
+
+    if (0 == len) {
+        if (0 != vma_map(&current_proc->vmas, DIR_ALIGN(MMAP_VIRT_ADDR), HUGE_PAGE_SIZE, VMA_READ | VMA_WRITE | VMA_HUGE)) {
+            return NULL;
+        }
+        return MMAP_VIRT_ADDR;
+    }
+    if (len > MMAP_AREA_END - MMAP_AREA_START) return NULL;
+
+    // Can't have writeable without readable on x86
+    uint32_t flags = prot & VMA_PROT_MASK;
+    if (flags & VMA_WRITE) flags |= VMA_READ;
+
+    uint32_t align = PAGE_SIZE;
+    if (0 == (len & (HUGE_PAGE_SIZE - 1))) {
+        flags |= VMA_HUGE;
+        align = HUGE_PAGE_SIZE;
+    }
+    else {
+        len = PAGE_ALIGN((len + PAGE_SIZE - 1));
+    }
+
+    uint32_t start = vma_find_free(current_proc->vmas, addr_hint, len, align, MMAP_AREA_START, MMAP_AREA_END);
+    if (!start) return NULL;
+    if (0 != vma_map(&current_proc->vmas, start, len, flags)) return NULL;
+    return start;
+}
+
+/*
+ * munmap
+ *
+ * Give back [addr, addr + len) (see vma_unmap). Only memory from mmap can be unmapped.
+ * Returns 0 on success, -1 on failure.
+ */
+int32_t sys_munmap (uint32_t addr, uint32_t len) {
+    if (!current_proc || current_proc->kern_proc) return -1;
+    if (addr < MMAP_AREA_START || addr >= MMAP_AREA_END || len > MMAP_AREA_END - addr) return -1;
+    return vma_unmap(&current_proc->as, &current_proc->vmas, addr, len);
+}
+
+/*
+ * brk
  *
- * This will grant a single huge page, and can only grant 1 page per process.
- * This returns the virtual address of the new huge page (or 0 if unsuccessful).
+ * Move the end of the heap to new_brk, anywhere in [USER_HEAP_START, USER_HEAP_END].
+ * Growing adds demand zeroed pages, shrinking frees whole pages past the new end. new_brk = 0 just asks.
+ * Returns the new break, or the old one if it couldn't be moved.
  */
-uint32_t sys_mmap () {
-    // A process only gets 1 mmap page
-    if (current_proc->mmap_phys_addr) return NULL;
-    current_proc->mmap_phys_addr = alloc_huge_page();
+uint32_t sys_brk (uint32_t new_brk) {
+    if (!current_proc || current_proc->kern_proc) return NULL;
+    if (new_brk < USER_HEAP_START || new_brk > USER_HEAP_END) return current_proc->brk;
+
+    uint32_t new_end = PAGE_ALIGN((new_brk + PAGE_SIZE - 1));
+    if (0 != vma_resize(&current_proc->as, &current_proc->vmas, USER_HEAP_START, new_end, VMA_READ | VMA_WRITE)) {
+        return current_proc->brk;
+    }
+    current_proc->brk = new_brk;
+    return new_brk;
+}
 
-    // Map the new page:
-    map_huge_page_user(MMAP_VIRT_ADDR, (uint32_t)current_proc->mmap_phys_addr);
+// What syscall_entry leaves at the top of a user process's kernel stack:
+// pushal, pushfl, then the iret frame the CPU pushed (eip, cs, eflags, esp, ss)
+#define SYSCALL_FRAME_WORDS ((8 + 1 + 5))
+#define SYSCALL_FRAME_EAX ((7))
 
-    return MMAP_VIRT_ADDR;
+/*
+ * fork
+ *
+ * Clone the calling user process. The child gets a copy of our PCB (user, file descriptors, FPU registers)
+ * and our memory, shared copy-on-write (see vma_fork), and comes back out of this same syscall with 0.
+ * It runs alongside us as a nonblocking process, nobody waits for it.
+ * Returns the child's PID to the parent, -1 on failure.
+ */
+int32_t sys_fork () {
+    pcb_t *parent = current_proc;
+    if (!parent || parent->kern_proc) return -1;
+
+    pcb_t *child = alloc_pcb();
+    if (!child) return -1;
+
+    if (!as_create(&child->as) || 0 != vma_fork(&parent->as, parent->vmas, &child->as, &child->vmas)) {
+        process_destroy(child);
+        return -1;
+    }
+
+    child->image = parent->image;
+    child->exe = parent->exe;
+    exec_image_hold(child->exe);
+    child->brk = parent->brk;
+    child->uid = parent->uid;
+    child->kern_proc = false;
+    child->nonblocking = true;
+    memcpy(child->fds, parent->fds, sizeof(child->fds));
+    memcpy(child->name, parent->name, FS_NAME_LEN);
+    fpu_fork(parent, child);
+
+    // Its kernel stack starts as a copy of our syscall frame (returning 0), with a frame on top for
+    // scheduler_pass to leave/ ret from into fork_child_entry
+    uint32_t *parent_frame = (uint32_t *)&parent->kern_stack[KERNEL_STACK_SIZE-1] - SYSCALL_FRAME_WORDS;
+    uint32_t *child_frame = (uint32_t *)&child->kern_stack[KERNEL_STACK_SIZE-1] - SYSCALL_FRAME_WORDS;
+    memcpyl(child_frame, parent_frame, SYSCALL_FRAME_WORDS);
+    child_frame[SYSCALL_FRAME_EAX] = 0;
+    child_frame[-1] = (uint32_t)fork_child_entry;
+    child_frame[-2] = 0;
+    child->ksp = (uint32_t)&child_frame[-2];
+    child->kbp = child->ksp;
+
+    sched_update(child);
+    return child->pid;
 }
 
 /********************
@@ -593,13 +890,23 @@ uint32_t sysexec(char *fname) {
 }
 
 #ifdef UIUCTF
-void process_sleep(uint32_t time) {
+// Timer callback: wake up the process in data
+static void _process_wake(void *data) {
+    pcb_t *process = (pcb_t *)data;
+    process->sleeping = false;
+    sched_update(process);
+}
+
+void process_sleep(uint32_t ms) {
     if (current_proc) {
-        current_proc->num_ticks_remaining = time;
+        uint32_t flags = cli_and_save();
         current_proc->sleeping = true;
+        timer_add(&current_proc->sleep_timer, ms, _process_wake, current_proc);
+        sched_update(current_proc);
         while (current_proc->sleeping) {
-            asm volatile("hlt");
+            scheduler_yield();
         }
+        restore_flags(flags);
     }
 }
 #endif
@@ -5,15 +5,39 @@
 #include "file.h"
 #include "user.h"
 #include "paging.h"
+#include "timer.h"
+#include "fpu.h"
+#include "vma.h"
 
 #define KERNEL_STACK_SIZE ((PAGE_SIZE * 4))
 
 #define PROC_VIRT_ADDR ((0x08048000))
 #define MMAP_VIRT_ADDR ((0x0D048000))
 
+// The user stack grows down from here (towards the end of the ELF image)
+#define USER_STACK_OFFSET ((0x200000))
+#define USER_STACK_TOP ((PROC_VIRT_ADDR + USER_STACK_OFFSET))
+
+// mmap puts everything in [MMAP_AREA_START, MMAP_AREA_END)
+#define MMAP_AREA_START ((0x0D000000))
+#define MMAP_AREA_END ((0x16000000))
+
+// The heap grows up from USER_HEAP_START (see sys_brk), as far as USER_HEAP_END
+#define USER_HEAP_START ((0x20000000))
+#define USER_HEAP_END ((0x60000000))
+
+// Could addr belong to a user process? (its image and stack, mmap area, or heap)
+// The kernel has its own windows in between (see paging.h, kernel.c), those don't count
+static inline bool is_user_addr(uint32_t addr) {
+    return (addr >= PROC_VIRT_ADDR && addr < USER_STACK_TOP) ||
+           (addr >= MMAP_AREA_START && addr < MMAP_AREA_END) ||
+           (addr >= USER_HEAP_START && addr < USER_HEAP_END);
+}
+
 #define NUM_FDS ((32))
 
-#define MAX_PROCESSES ((32))
+// Size of the PID space (PCBs themselves are allocated on demand, see alloc_pcb):
+#define MAX_PROCESSES ((1024))
 
 // 0x7F followed by "ELF" but in little-endian order
 #define ELF_MAGIC ((0x464c457f))
@@ -50,19 +74,32 @@ typedef struct pcb_t {
     uint32_t parent_ksp;
     uint32_t parent_kbp;
 
-    /*
-     * phys_addr
-     *
-     * Physical address of the memory storing this process
-     */
-    void *phys_addr;
+    // ELF layout (user processes only)
+    elf_image_t image;
+
+    // Shared image of the binary this is running (we hold a reference), the file backed areas in vmas point at this
+    exec_image_t *exe;
 
     /*
-     * mmap_phys_addr
+     * vmas
      *
-     * Physical address of the page mapped by mmap, if any
+     * Every area of this process's memory (ELF segments, stack, mmap), sorted by address (see vma.h)
      */
-    void *mmap_phys_addr;
+    vma_t *vmas;
+
+    // End of the heap (program break), the heap area is [USER_HEAP_START, brk rounded up to a page)
+    uint32_t brk;
+
+    // Page faults that filled in a page from the ELF/ with zeroes/ mapped a page another process read in/
+    // copied a page shared since a fork, and time spent on them:
+    uint32_t faults_file;
+    uint32_t faults_zero;
+    uint32_t faults_shared;
+    uint32_t faults_cow;
+    uint64_t fault_ns;
+
+    // Page directory (kernel processes all share the kernel's, see paging.h)
+    addr_space_t as;
 
     // File descriptor array:
     fd_t fds[NUM_FDS];
@@ -92,8 +129,30 @@ typedef struct pcb_t {
     bool nonblocking;
 
     // Are we asleep?
+    // sleep_timer clears this when it goes off
     bool sleeping;
-    uint32_t num_ticks_remaining;
+    timer_t sleep_timer;
+
+    // Run queue links (see sched_update in scheduler.c):
+    struct pcb_t *run_next;
+    struct pcb_t *run_prev;
+    bool on_runq;
+
+    // Time slice budget: PIT ticks left before scheduler_tick preempts us
+    uint32_t slice_ticks_left;
+
+    // Scheduling level (0 is the highest priority, see scheduler.c)
+    uint32_t priority;
+
+    // Are we blocked waiting on input? (see sched_wait_flag)
+    // While waiting, wait_flag is the flag that has to clear for us to wake up
+    bool waiting_io;
+    volatile bool *wait_flag;
+    struct pcb_t *wait_next;
+
+    // Saved FPU/ SSE registers (only valid once fpu_used is set, see fpu.c)
+    uint8_t fpu_state[FPU_STATE_SIZE] __attribute__((aligned(16)));
+    bool fpu_used;
 
     // Next time this process is scheduled it'll execute sysret
     bool should_die;
@@ -106,8 +165,11 @@ typedef struct pcb_t {
     uid_t set_uid_val;  // UID val
 
 
-    // Kernel stack for this process:
-    uint8_t kern_stack[KERNEL_STACK_SIZE];
+    // Process ID (index into the PID table):
+    uint32_t pid;
+
+    // Kernel stack for this process (KERNEL_STACK_SIZE bytes, allocated separately from the PCB):
+    uint8_t *kern_stack;
 } pcb_t;
 
 // Setup a PCB
@@ -125,10 +187,9 @@ pcb_t *alloc_pcb();
  * kernel_proc- When true, we setup the PCB to be a kernel PCB
  *
  * For user processes:
- * Sets up a new PCB, loads ELF into memory, and updates page mappings accordingly.
+ * Sets up a new PCB and address space, and loads the ELF into it.
  * Can fail because filename doesn't exist, isn't an ELF, or no more PCBs free
- * WARNING: Even if this fails, the page table mappings will remain modified!
- * @TODO: Make this clean page tables up
+ * On success the new address space is left loaded, on failure the caller's is put back.
  *
  * For kernel processes:
  * Allocates a new PCB with no file descriptors and marks it as a kernel process.
@@ -163,7 +224,8 @@ uint32_t process_launch(pcb_t *process, void *code_addr, void *stack_addr, pcb_t
  * Sets up and launches a new user process. This function will appear to return with the
  * return value asked for by the caller.
  *
- * Uses the ELF entrypoint as code address, and USER_STACK_OFFSET into the huge page as the stack base.
+ * Uses the ELF entrypoint as code address. Everything from the end of the image up to USER_STACK_TOP
+ * is mapped as a read/ write VMA that's filled in on demand, and the stack pointer starts at USER_STACK_TOP.
  *
  * process- the PCB to use.
  */
@@ -228,8 +290,15 @@ uint32_t sysret(uint32_t retval);
 // Exec syscall:
 uint32_t sysexec(char *fname);
 
-// mmap syscall:
-uint32_t sys_mmap(void);
+// mmap/ munmap syscalls:
+uint32_t sys_mmap(uint32_t addr_hint, uint32_t len, uint32_t prot);
+int32_t sys_munmap(uint32_t addr, uint32_t len);
+
+// fork syscall:
+int32_t sys_fork(void);
+
+// brk syscall:
+uint32_t sys_brk(uint32_t new_brk);
 
 // Remote switch user:
 
@@ -269,11 +338,23 @@ static inline int32_t create_kernel_process_here () {
 
 extern pcb_t *current_proc;
 
-extern pcb_t processes[MAX_PROCESSES];
+// Look up a live process by PID (NULL if there isn't one)
+pcb_t *pid_to_pcb(uint32_t pid);
+
+/*
+ * process_next
+ *
+ * Find the first live process with a PID >= *pid, and write its PID back into *pid.
+ * Returns NULL once there are no more. Use for_each_process to walk every process.
+ */
+pcb_t *process_next(uint32_t *pid);
+
+#define for_each_process(pid, p) for ((pid) = 0; ((p) = process_next(&(pid))) != NULL; (pid)++)
 
 #include "sandbox.h"
 #ifdef UIUCTF
-void process_sleep(uint32_t time);
+// Sleep for ms milliseconds (blocks the current process)
+void process_sleep(uint32_t ms);
 #endif
 
 #endif
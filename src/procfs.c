@@ -3,6 +3,40 @@
 #include "file.h"
 #include "process.h"
 #include "types.h"
+#include "scheduler.h"
+#include "bench.h"
+#include "exec_cache.h"
+#include "zpool.h"
+#include "dcache.h"
+#include "kmalloc.h"
+#include "pmm.h"
+
+// Write the contents of a /proc file into buf (at most size bytes), returns bytes written
+typedef size_t (*proc_gen_t)(char *buf, size_t size);
+
+typedef struct {
+    char *path;
+    proc_gen_t gen;
+} proc_file_t;
+
+static size_t _proc_all(char *buf, size_t size);
+static size_t _proc_sched(char *buf, size_t size);
+static size_t _proc_faults(char *buf, size_t size);
+
+// Every file in /proc:
+static proc_file_t proc_files[] = {
+    { "proc/all", _proc_all },
+    { "proc/sched", _proc_sched },
+    { "proc/bench", bench_report },
+    { "proc/exec_cache", exec_cache_report },
+    { "proc/meminfo", pmm_report },
+    { "proc/kmalloc", kmalloc_report },
+    { "proc/faults", _proc_faults },
+    { "proc/zpool", zpool_report },
+    { "proc/dcache", dcache_report },
+};
+
+#define NUM_PROC_FILES ((sizeof(proc_files) / sizeof(proc_files[0])))
 
 // Outward facing API for using this filesystem:
 // Return true if the file exists, false otherwise
@@ -12,15 +46,20 @@ uint32_t proc_open(fd_t *fd, char *fname) {
     if (!fname) return false;
 
     // Attempt to open the file:
-    // This file system contains just 1 file, /proc/all
     char *cursor = fname;
     while (*cursor == '/') cursor++;
-    if (!strncmp(cursor, "proc/all", MAX_MOUNTPOINT_PATH)) return false;
 
-    fd->fs_offset = 0;
+    uint32_t i;
+    for (i = 0; i < NUM_PROC_FILES; i++) {
+        if (strncmp(cursor, proc_files[i].path, MAX_MOUNTPOINT_PATH)) {
+            // Found file, update fd:
+            fd->proc_file = i;
+            fd->fs_offset = 0;
+            return true;
+        }
+    }
 
-    // Found file, update fd:
-    return true;
+    return false;
 }
 
 void proc_close(fd_t *fd) {
@@ -39,33 +78,89 @@ size_t _proc_read_copy_to_buffer (char *to, char *from, size_t max_bytes, size_t
 size_t proc_read(fd_t *fd, char *buf, size_t size) {
     if (!fd) return 0;
     if (!buf) return 0;
-    size_t bytes_read = 0;
-    uint32_t i = 0;
+    if (fd->proc_file >= NUM_PROC_FILES) return 0;
 
     if (fd->fs_offset != 0) {
         // @TODO: Seek in the proc FS
         return 0;
     }
 
+    size_t bytes_read = proc_files[fd->proc_file].gen(buf, size);
+
+    fd->fs_offset += bytes_read;
+    return bytes_read;
+}
+
+// /proc/all: List all processes
+static size_t _proc_all(char *buf, size_t size) {
+    size_t bytes_read = 0;
+    uint32_t pid = 0;
+    pcb_t *p;
+
     // char headerbuf[64];
     // strncpy(headerbuf, "Proclist: List all processes\n[PID]: [NAME]\n", sizeof(headerbuf));
     // _proc_read_copy_to_buffer(buf, headerbuf, size, &bytes_read);
 
-    for (i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i].in_use) {
-            char linebuf[128];
-            if (processes[i].kern_proc) {
-                snprintf(linebuf, sizeof(linebuf), "%x: %s [KERNEL]\n", i, processes[i].name);
-            }
-            else {
-                snprintf(linebuf, sizeof(linebuf), "%x: %s (UID = %x)\n", i, processes[i].name, processes[i].uid);
-            }
-
-            _proc_read_copy_to_buffer(buf, linebuf, size, &bytes_read);
+    for_each_process(pid, p) {
+        char linebuf[128];
+        if (p->kern_proc) {
+            snprintf(linebuf, sizeof(linebuf), "%x: %s [KERNEL]\n", pid, p->name);
+        }
+        else {
+            snprintf(linebuf, sizeof(linebuf), "%x: %s (UID = %x)\n", pid, p->name, p->uid);
         }
+
+        _proc_read_copy_to_buffer(buf, linebuf, size, &bytes_read);
+        if (bytes_read + 1 >= size) break;
+    }
+
+    return bytes_read;
+}
+
+// /proc/sched: Scheduling level and state of every process
+static size_t _proc_sched(char *buf, size_t size) {
+    size_t bytes_read = 0;
+    uint32_t pid = 0;
+    pcb_t *p;
+    char linebuf[128];
+
+    snprintf(linebuf, sizeof(linebuf), "Quantum: %x ms, Levels: %x, Boost: %x ms\n[PID]: [NAME] [PRIO] [STATE]\n",
+        scheduler_get_quantum(), SCHED_NUM_LEVELS, SCHED_BOOST_MS);
+    _proc_read_copy_to_buffer(buf, linebuf, size, &bytes_read);
+
+    for_each_process(pid, p) {
+        char *state = "RUN";
+        if (p->waiting_io) state = "INPUT";
+        else if (p->sleeping) state = "SLEEP";
+        else if (p->blocking_execute) state = "EXEC";
+
+        snprintf(linebuf, sizeof(linebuf), "%x: %s %x %s\n", pid, p->name, p->priority, state);
+        _proc_read_copy_to_buffer(buf, linebuf, size, &bytes_read);
+        if (bytes_read + 1 >= size) break;
+    }
+
+    return bytes_read;
+}
+
+// /proc/faults: Demand paging faults of every user process, and how long they took
+static size_t _proc_faults(char *buf, size_t size) {
+    size_t bytes_read = 0;
+    uint32_t pid = 0;
+    pcb_t *p;
+    char linebuf[128];
+
+    strncpy(linebuf, "[PID]: [NAME] [FILE] [ZERO] [SHARED] [COW] [US]\n", sizeof(linebuf));
+    _proc_read_copy_to_buffer(buf, linebuf, size, &bytes_read);
+
+    for_each_process(pid, p) {
+        if (p->kern_proc) continue;
+
+        snprintf(linebuf, sizeof(linebuf), "%x: %s %u %u %u %u %u\n", pid, p->name,
+            p->faults_file, p->faults_zero, p->faults_shared, p->faults_cow, div_u64_u32(p->fault_ns, 1000, NULL));
+        _proc_read_copy_to_buffer(buf, linebuf, size, &bytes_read);
+        if (bytes_read + 1 >= size) break;
     }
 
-    fd->fs_offset += bytes_read;
     return bytes_read;
 }
 
@@ -7,7 +7,4 @@ void init_rtc();
 
 void rtc_handler();
 
-// Timeout timer:
-extern uint32_t ticks_since_kb;
-
 #endif
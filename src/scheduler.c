@@ -2,10 +2,296 @@
 #include "process.h"
 #include "interrupt.h"
 #include "util.h"
+#include "pit.h"
+#include "timer.h"
+#include "clock.h"
+#include "zpool.h"
 
-void scheduler_pass() {
+// Time slice length:
+static uint32_t sched_quantum_ms = SCHED_DEFAULT_QUANTUM_MS;
+uint32_t sched_slice_ticks = 1;
+
+// How often every runnable process gets bumped back up to the top level (in PIT ticks):
+static uint32_t sched_boost_ticks = 1;
+static uint32_t sched_last_boost = 0;
+
+void scheduler_set_quantum(uint32_t ms) {
+    if (ms < SCHED_MIN_QUANTUM_MS) ms = SCHED_MIN_QUANTUM_MS;
+    if (ms > SCHED_MAX_QUANTUM_MS) ms = SCHED_MAX_QUANTUM_MS;
+    sched_quantum_ms = ms;
+
+    // Round to the nearest whole tick, but always give out at least 1:
+    uint32_t ticks = (ms * pit_get_frequency() + 500) / 1000;
+    sched_slice_ticks = (ticks == 0) ? 1 : ticks;
+
+    // The boost period is in ms too, so it also has to follow the tick rate:
+    ticks = (SCHED_BOOST_MS * pit_get_frequency()) / 1000;
+    sched_boost_ticks = (ticks == 0) ? 1 : ticks;
+}
+
+uint32_t scheduler_get_quantum() {
+    return sched_quantum_ms;
+}
+
+/*
+ * Multilevel feedback queue
+ *
+ * Each priority level has its own ring of runnable processes, threaded through pcb_t.
+ * We always run the highest non-empty level, round robin within it.
+ *  - Everyone starts at level 0
+ *  - Burning a whole time slice drops a process one level (CPU hogs sink)
+ *  - Blocking for input puts a process back on level 0 (interactive stuff floats)
+ *  - Every SCHED_BOOST_MS all runnable processes go back to level 0, so nothing starves
+ * Lower levels get longer slices (sched_slice_ticks << level) so hogs switch less often.
+ */
+static pcb_t *runq_heads[SCHED_NUM_LEVELS];
+
+// Processes blocked in sched_wait_flag (singly linked through wait_next):
+static pcb_t *wait_head = NULL;
+
+// Set when someone more important than current_proc wakes up, makes the next tick preempt
+static bool need_resched = false;
+
+// The idle process: never on the run queue, only runs when the queue is empty
+// It doesn't live in the process table so it never shows up in /proc or takes a PID
+static pcb_t idle_pcb;
+static uint8_t idle_stack[KERNEL_STACK_SIZE] __attribute__((aligned(16)));
+
+// Did the idle process mask the PIT?
+static bool idle_masked_pit = false;
+
+// Insert at the tail of the ring for this process's level (right before head)
+static inline void _runq_enqueue(pcb_t *process) {
+    pcb_t **head = &runq_heads[process->priority];
+    if (NULL == *head) {
+        process->run_next = process;
+        process->run_prev = process;
+        *head = process;
+    }
+    else {
+        process->run_next = *head;
+        process->run_prev = (*head)->run_prev;
+        (*head)->run_prev->run_next = process;
+        (*head)->run_prev = process;
+    }
+    process->on_runq = true;
+}
+
+static inline void _runq_dequeue(pcb_t *process) {
+    pcb_t **head = &runq_heads[process->priority];
+    if (process->run_next == process) {
+        // Last one in the ring
+        *head = NULL;
+    }
+    else {
+        process->run_prev->run_next = process->run_next;
+        process->run_next->run_prev = process->run_prev;
+        if (*head == process) {
+            *head = process->run_next;
+        }
+    }
+    process->run_next = NULL;
+    process->run_prev = NULL;
+    process->on_runq = false;
+}
+
+// Head of the highest priority non-empty level, or NULL if nothing is runnable
+static inline pcb_t *_runq_first() {
+    uint32_t level;
+    for (level = 0; level < SCHED_NUM_LEVELS; level++) {
+        if (NULL != runq_heads[level]) return runq_heads[level];
+    }
+    return NULL;
+}
+
+static inline void _waitq_remove(pcb_t *process) {
+    pcb_t **link = &wait_head;
+    while (NULL != *link) {
+        if (*link == process) {
+            *link = process->wait_next;
+            break;
+        }
+        link = &(*link)->wait_next;
+    }
+    process->wait_next = NULL;
+    process->wait_flag = NULL;
+    process->waiting_io = false;
+}
+
+void sched_update(pcb_t *process) {
+    if (!process || process == &idle_pcb) return;
+    uint32_t flags = cli_and_save();
+
+    // Dead processes can't be waiting on anything
+    if (!process->in_use && process->waiting_io) {
+        _waitq_remove(process);
+    }
+
+    bool runnable = process->in_use && !process->blocking_execute && !process->sleeping && !process->waiting_io;
+    if (runnable && !process->on_runq) {
+        _runq_enqueue(process);
+
+        // Preempt whoever is running if this one outranks them:
+        if (NULL != current_proc && process->priority < current_proc->priority) {
+            need_resched = true;
+        }
+    }
+    else if (!runnable && process->on_runq) {
+        _runq_dequeue(process);
+    }
+
+    restore_flags(flags);
+}
+
+void sched_set_priority(pcb_t *process, uint32_t level) {
+    if (!process || process == &idle_pcb) return;
+    if (level >= SCHED_NUM_LEVELS) level = SCHED_NUM_LEVELS - 1;
+    uint32_t flags = cli_and_save();
+
+    if (process->on_runq) {
+        _runq_dequeue(process);
+        process->priority = level;
+        _runq_enqueue(process);
+    }
+    else {
+        process->priority = level;
+    }
+
+    restore_flags(flags);
+}
+
+void sched_wait_flag(volatile bool *flag) {
+    // Nobody to hand the CPU to (or no tick to bring us back), so just halt in place:
+    // sys_alert masks the PIT while it reads, and nothing can wake the idle process up
+    if (NULL == current_proc || current_proc == &idle_pcb || hw_pic_is_masked(IRQ_PIT)) {
+        while (*flag) { asm volatile ("hlt"); }
+        return;
+    }
+
+    uint32_t flags = cli_and_save();
+    while (*flag && !current_proc->should_die) {
+        current_proc->waiting_io = true;
+        current_proc->wait_flag = flag;
+        current_proc->wait_next = wait_head;
+        wait_head = current_proc;
+        sched_update(current_proc);
+
+        // Waiting on a human means we're interactive, go to the front of the line
+        sched_set_priority(current_proc, 0);
+
+        // Comes back once sched_wake_flags puts us back on the run queue
+        scheduler_yield();
+    }
+    restore_flags(flags);
+}
+
+void sched_wake_flags() {
+    uint32_t flags = cli_and_save();
+    pcb_t **link = &wait_head;
+    while (NULL != *link) {
+        pcb_t *process = *link;
+        if (*process->wait_flag) {
+            link = &process->wait_next;
+            continue;
+        }
+
+        *link = process->wait_next;
+        process->wait_next = NULL;
+        process->wait_flag = NULL;
+        process->waiting_io = false;
+        sched_update(process);
+    }
+    restore_flags(flags);
+}
+
+void sched_kill(pcb_t *process) {
+    if (!process) return;
+    uint32_t flags = cli_and_save();
+    process->should_die = true;
+
+    // Somebody blocked on input or asleep would never get scheduled to notice, so wake them up
+    if (process->waiting_io) {
+        _waitq_remove(process);
+    }
+    if (process->sleeping) {
+        timer_cancel(&process->sleep_timer);
+        process->sleeping = false;
+    }
+    sched_update(process);
+    restore_flags(flags);
+}
+
+// Put every runnable process back on level 0
+static void _sched_boost_all() {
+    uint32_t level;
+    for (level = 1; level < SCHED_NUM_LEVELS; level++) {
+        while (NULL != runq_heads[level]) {
+            pcb_t *process = runq_heads[level];
+            _runq_dequeue(process);
+            process->priority = 0;
+            _runq_enqueue(process);
+        }
+    }
+    if (NULL != current_proc && current_proc != &idle_pcb) {
+        current_proc->priority = 0;
+    }
+}
+
+// Move time forward by ticks PIT ticks (more than 1 when catching up after a one-shot),
+// running any timers that expire
+static void _sched_account_ticks(uint32_t ticks) {
+    pit_ticks += ticks;
+    clock_account_ticks(ticks);
+    timer_run(ticks);
+}
+
+// Charge this tick to the current process
+// Only ask for a reschedule once its slice is used up
+bool scheduler_tick() {
     hw_pic_eoi(IRQ_PIT);
 
+    if (pit_in_oneshot()) {
+        // The idle process put the PIT into one-shot mode, this IRQ stands for all the ticks it slept through
+        _sched_account_ticks(pit_oneshot_irq());
+
+        // Not at its deadline yet (the next one-shot is already armed) and nobody woke up, back to sleep
+        if (pit_in_oneshot() && NULL == _runq_first()) return false;
+    }
+    else {
+        _sched_account_ticks(1);
+    }
+
+    if (pit_ticks - sched_last_boost >= sched_boost_ticks) {
+        sched_last_boost = pit_ticks;
+        _sched_boost_all();
+    }
+
+    // Nobody is running, or whoever is running can't continue:
+    if (NULL == current_proc) return true;
+    if (!current_proc->on_runq || current_proc->should_die) {
+        return true;
+    }
+
+    // Something with a better priority became runnable:
+    if (need_resched) {
+        need_resched = false;
+        return true;
+    }
+
+    if (current_proc->slice_ticks_left > 1) {
+        current_proc->slice_ticks_left--;
+        return false;
+    }
+
+    // Slice is used up, so this is a CPU hog- drop it a level:
+    current_proc->slice_ticks_left = 0;
+    if (current_proc->priority + 1 < SCHED_NUM_LEVELS) {
+        sched_set_priority(current_proc, current_proc->priority + 1);
+    }
+    return true;
+}
+
+void scheduler_pass() {
     // Step 1: Save current process kernel stack
     // I think we can get away with just using esp and forgetting ebp; it'll get corrected
     // during linkage at the end of this call
@@ -18,61 +304,148 @@ void scheduler_pass() {
     }
 
     // Step 2: Choose the next process to run
-    uint32_t current_proc_idx = 0;
-
-    // Set current_proc_idx to the index in the process table that current_proc is
-    current_proc_idx = (current_proc != NULL) ? (current_proc - (pcb_t*)processes) : 0;
-
-    // Ensure the index is in range (ie, current_proc points to something in the table)
-    if (current_proc_idx >= MAX_PROCESSES) {
-        current_proc_idx = 0;
-    }
-
-    pcb_t *next_proc = current_proc;
-    uint32_t j;
-    for (j = 0; j < MAX_PROCESSES; j++) {
-        // Map i of 0 to current proc, and i of MAX_PROCESSES-1 to the process right before current_proc,
-        // wrapping around as necessary:
-        uint32_t idx = (current_proc_idx + 1 + j) % MAX_PROCESSES;
-        
-        if (processes[idx].in_use && !processes[idx].blocking_execute && !processes[idx].sleeping) {
-            // This is the process we want
-            next_proc = &processes[idx];
-            break;
-        }
+    // Take the highest priority level with anything on it.
+    // Each level is a ring, so if we're on that level whoever is after us is next in line,
+    // otherwise start from the head of the level.
+    // If nothing is runnable at all, run the idle process.
+    need_resched = false;
+    pcb_t *next_proc = _runq_first();
+    if (NULL == next_proc) {
+        next_proc = &idle_pcb;
+    }
+    else if (NULL != current_proc && current_proc->on_runq && current_proc->priority == next_proc->priority) {
+        next_proc = current_proc->run_next;
     }
 
-    if (next_proc != NULL) {
-        // Step 3: Configure page mappings for the new process
+    // Hand out a fresh time slice (longer the lower the level):
+    next_proc->slice_ticks_left = sched_slice_ticks << next_proc->priority;
+
+    // Step 3: Configure page mappings for the new process
+    // (Nothing to do if we are just continuing the current process)
+    if (next_proc != current_proc) {
         process_switch(next_proc);
+    }
+
+    // Step 3.5: If this process should be killed, kill it
+    if (next_proc->should_die) {
+        sysret(-8);
+    }
+
+    // Step 4: Swap to that process's kernel stack (restore KSP)
+    // Step 5: GTFO!
+    asm volatile (
+        "movl %0, %%esp\n" \
+        "movl %1, %%ebp\n" \
+        "leave\n" \
+        "ret\n" \
+        :
+        : "rm"(current_proc->ksp), "rm"(current_proc->kbp)
+    );
+}
+
+/*
+ * idle_loop
+ *
+ * Body of the idle process. Halts until an interrupt makes something runnable,
+ * then hands the CPU over to it.
+ *
+ * Until the zeroed page pools are full (see zpool.h) it works on those in between.
+ *
+ * While idle there is nothing to preempt, so the PIT doesn't need to tick:
+ *  - If a timer is pending, the PIT is switched to one-shot mode with the next timer as its deadline.
+ *    One-shots only reach ~55ms, so far off deadlines take a chain of them, but the IRQ 0 handler
+ *    re-arms those by itself (see pit_oneshot_irq): we just wake up, see there's still nothing to do, and halt again.
+ *  - Otherwise IRQ 0 is masked completely (readers are woken by the keyboard).
+ *    The keyboard timeout is always pending once the keyboard is setup, so in practice it's the chain.
+ * Something becoming runnable (or an earlier timer turning up) ends the one-shot early,
+ * and the time it covered so far is caught up on.
+ */
+static void idle_loop() {
+    while (1) {
+        cli();
+
+        if (NULL != _runq_first() || zpool_needs_refill()) {
+            // Got something to do, so bring the tick back
+            if (pit_in_oneshot()) {
+                _sched_account_ticks(pit_stop_oneshot());
+            }
+            if (idle_masked_pit) {
+                idle_masked_pit = false;
+                hw_pic_unmask(IRQ_PIT);
+            }
+
+            // Someone woke up, let them run:
+            if (NULL != _runq_first()) {
+                scheduler_yield();
+                continue;
+            }
 
-        // Step 3.5: If this process should be killed, kill it
-        if (next_proc->should_die) {
-            sysret(-8);
+            // Nothing to run, so get some pages zeroed for later. One at a time with interrupts on
+            // (and the tick running), so anyone who wakes up meanwhile only waits for one page.
+            // If we're out of memory the pools stop asking for more (zpool_needs_refill), and we halt below
+            sti();
+            zpool_refill_step();
+            continue;
         }
 
-        // Step 4: Swap to that process's kernel stack (restore KSP)
-        // Step 5: GTFO!
-        asm volatile (
-            "movl %0, %%esp\n" \
-            "movl %1, %%ebp\n" \
-            "leave\n" \
-            "ret\n" \
-            :
-            : "rm"(current_proc->ksp), "rm"(current_proc->kbp)
-        );
-    }
-    else {
-        // No available processes, go to sleep
-        // sti();
-        // asm volatile ("hlt");
-        return;
+        uint32_t next_timer = timer_ticks_until_next();
+        if (pit_in_oneshot()) {
+            // Already asleep until the next timer, unless one was added that goes off sooner
+            if (next_timer < pit_oneshot_ticks_left()) {
+                _sched_account_ticks(pit_stop_oneshot());
+                continue;
+            }
+        }
+        else if (TIMER_NONE == next_timer) {
+            if (!idle_masked_pit) {
+                idle_masked_pit = true;
+                hw_pic_mask(IRQ_PIT);
+            }
+        }
+        else {
+            if (idle_masked_pit) {
+                idle_masked_pit = false;
+                hw_pic_unmask(IRQ_PIT);
+            }
+            pit_start_oneshot(next_timer);
+        }
+
+        // sti only takes effect after the next instruction, so nothing can sneak in
+        // between checking the run queue and halting
+        asm volatile ("sti\n" "hlt\n");
     }
 }
 
-// Configure PIT (IRQ 0)
-void init_pit () {
-    // outb(0x43, 0x36);
-    // outb(0x40, 0x9b);
-    // outb(0x40, 0x2e);
+// Setup the idle process
+void init_scheduler () {
+    idle_pcb.in_use = true;
+    idle_pcb.kern_proc = true;
+    idle_pcb.uid = 0;
+    idle_pcb.exe = NULL;
+    idle_pcb.image.num_segments = 0;
+    idle_pcb.vmas = NULL;
+    as_init_kernel(&idle_pcb.as);
+    idle_pcb.blocking_execute = false;
+    idle_pcb.nonblocking = true;
+    idle_pcb.sleeping = false;
+    idle_pcb.should_die = false;
+    idle_pcb.on_runq = false;
+    idle_pcb.priority = SCHED_NUM_LEVELS;
+    idle_pcb.waiting_io = false;
+    fpu_init_process(&idle_pcb);
+    idle_pcb.run_next = NULL;
+    idle_pcb.run_prev = NULL;
+    idle_pcb.pid = MAX_PROCESSES;
+    idle_pcb.kern_stack = idle_stack;
+    strncpy((char *)&idle_pcb.name, "idle", FS_NAME_LEN);
+
+    // Build a stack frame that scheduler_pass can "leave, ret" out of straight into idle_loop:
+    // [kbp] -> saved ebp (0), then the return address (idle_loop), then idle_loop's own
+    // return address (0, it never returns)
+    uint32_t *sp = (uint32_t *)&idle_pcb.kern_stack[KERNEL_STACK_SIZE];
+    *(--sp) = 0;
+    *(--sp) = (uint32_t)idle_loop;
+    *(--sp) = 0;
+    idle_pcb.ksp = (uint32_t)sp;
+    idle_pcb.kbp = (uint32_t)sp;
 }
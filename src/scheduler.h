@@ -1,5 +1,21 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
+#include "types.h"
+
+struct pcb_t;
+
+// Default length of a time slice (ms):
+#define SCHED_DEFAULT_QUANTUM_MS ((20))
+
+// Bounds on the time slice length (ms):
+#define SCHED_MIN_QUANTUM_MS ((1))
+#define SCHED_MAX_QUANTUM_MS ((1000))
+
+// Number of priority levels in the feedback queue (0 is the highest):
+#define SCHED_NUM_LEVELS ((3))
+
+// How often everyone gets reset to the top level (ms):
+#define SCHED_BOOST_MS ((1000))
 
 /*
  *
@@ -13,10 +29,86 @@
  */
 void scheduler_pass(void);
 
+/*
+ * sched_update
+ *
+ * Put a process on or take it off the run queue to match its state.
+ * A process is runnable when it is in_use, not sleeping, not waiting on input
+ * and not waiting on a blocking execute.
+ *
+ * Call this after every change to any of those fields- the scheduler only ever looks
+ * at the run queue, so picking the next process is O(1) no matter how big the process table is.
+ */
+void sched_update(struct pcb_t *process);
+
+/*
+ * sched_set_priority
+ *
+ * Move a process to a different level of the feedback queue.
+ */
+void sched_set_priority(struct pcb_t *process, uint32_t level);
+
+/*
+ * sched_wait_flag
+ *
+ * Block the current process until an interrupt handler clears *flag.
+ * The process is taken off the run queue (instead of spinning on hlt) and
+ * boosted to the top level, since it is waiting on the user.
+ * Whoever clears the flag must call sched_wake_flags afterwards.
+ *
+ * If there is no process to block (or the PIT is masked), this just halts until the flag clears.
+ */
+void sched_wait_flag(volatile bool *flag);
+
+// Wake up every process in sched_wait_flag whose flag was cleared
+void sched_wake_flags(void);
+
+/*
+ * sched_kill
+ *
+ * Set should_die on a process, waking it up first if it is blocked on input
+ * or asleep so that it actually gets scheduled and killed.
+ */
+void sched_kill(struct pcb_t *process);
+
+/*
+ * scheduler_tick
+ *
+ * Called by scheduler_entry on every IRQ 0.
+ * Advances pit_ticks and the timer wheel.
+ * Charges the tick to the current process's time slice, demoting it a level if it used the whole thing.
+ * Also resets everyone to the top level every SCHED_BOOST_MS.
+ *
+ * Returns true if the current process should be preempted (its slice ran out,
+ * or it can't keep running), in which case scheduler_entry calls scheduler_pass.
+ */
+bool scheduler_tick(void);
+
+/*
+ * scheduler_set_quantum
+ *
+ * Set the length of a time slice in ms (clamped to SCHED_MIN/MAX_QUANTUM_MS).
+ * The slice is rounded to a whole number of PIT ticks (at least 1).
+ */
+void scheduler_set_quantum(uint32_t ms);
+uint32_t scheduler_get_quantum(void);
+
+// Length of a full time slice in PIT ticks:
+extern uint32_t sched_slice_ticks;
+
+// Setup the idle process
+void init_scheduler(void);
+
+/*
+ * scheduler_yield
+ *
+ * Give up the CPU from kernel code.
+ * Wraps scheduler_pass with the same register/ flag save as the IRQ 0 entrypoint,
+ * so it is safe to call from any C function.
+ */
+extern void scheduler_yield(void);
+
 // Scheduler interrupt entrypoint:
 extern void scheduler_entry(void);
 
-// Configure PIT (IRQ 0)
-void init_pit (void);
-
 #endif
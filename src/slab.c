@@ -0,0 +1,130 @@
+#include "slab.h"
+#include "paging.h"
+#include "util.h"
+
+// Round x up to a multiple of align (a power of 2)
+#define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+
+static inline void _slab_push(slab_t **list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static inline void _slab_unlink(slab_t **list, slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+void slab_cache_init(slab_cache_t *cache, char *name, size_t obj_size, size_t align) {
+    if (align < sizeof(void *)) align = sizeof(void *);
+    size_t slab_size = (ALIGN_UP(obj_size, align) > PAGE_SIZE / 8) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    slab_cache_init_size(cache, name, obj_size, align, slab_size);
+}
+
+void slab_cache_init_size(slab_cache_t *cache, char *name, size_t obj_size, size_t align, size_t slab_size) {
+    if (!cache) return;
+    if (align < sizeof(void *)) align = sizeof(void *);
+
+    cache->name = name;
+    cache->obj_size = ALIGN_UP(obj_size, align);
+    cache->slab_size = (slab_size == HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    cache->first_obj = ALIGN_UP(sizeof(slab_t), align);
+    cache->objs_per_slab = (cache->slab_size - cache->first_obj) / cache->obj_size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->num_slabs = 0;
+    cache->num_in_use = 0;
+}
+
+// Get a new slab and thread all of its objects onto its free list
+static slab_t *_slab_grow(slab_cache_t *cache) {
+    uint8_t *mem = (cache->slab_size == HUGE_PAGE_SIZE) ? kernel_alloc_huge_page() : kernel_alloc_page();
+    if (!mem) return NULL;
+
+    slab_t *slab = (slab_t *)mem;
+    slab->cache = cache;
+    slab->num_in_use = 0;
+    slab->free_list = NULL;
+
+    // Push in reverse so objects come out in address order:
+    uint32_t i = cache->objs_per_slab;
+    while (i > 0) {
+        i--;
+        void *obj = mem + cache->first_obj + i * cache->obj_size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    _slab_push(&cache->partial, slab);
+    cache->num_slabs++;
+    return slab;
+}
+
+static void _slab_release(slab_cache_t *cache, slab_t *slab) {
+    _slab_unlink(&cache->partial, slab);
+    cache->num_slabs--;
+    if (cache->slab_size == HUGE_PAGE_SIZE) {
+        kernel_free_huge_page(slab);
+    }
+    else {
+        kernel_free_page(slab);
+    }
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+    if (!cache) return NULL;
+    uint32_t flags = cli_and_save();
+
+    slab_t *slab = cache->partial;
+    if (NULL == slab) {
+        slab = _slab_grow(cache);
+        if (NULL == slab) {
+            restore_flags(flags);
+            return NULL;
+        }
+    }
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->num_in_use++;
+    cache->num_in_use++;
+
+    // Took the last one, move it over to the full list:
+    if (NULL == slab->free_list) {
+        _slab_unlink(&cache->partial, slab);
+        _slab_push(&cache->full, slab);
+    }
+
+    restore_flags(flags);
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj) {
+    if (!cache || !obj) return;
+    uint32_t flags = cli_and_save();
+
+    slab_t *slab = (slab_t *)((uint32_t)obj & ~(cache->slab_size - 1));
+
+    // Was full, now it has room again:
+    if (NULL == slab->free_list) {
+        _slab_unlink(&cache->full, slab);
+        _slab_push(&cache->partial, slab);
+    }
+
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->num_in_use--;
+    cache->num_in_use--;
+
+    // Give empty slabs back, unless it's the only one we have (saves thrashing on alloc/ free/ alloc/ ...)
+    if (0 == slab->num_in_use && (slab->next || slab->prev)) {
+        _slab_release(cache, slab);
+    }
+
+    restore_flags(flags);
+}
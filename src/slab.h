@@ -0,0 +1,61 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include "types.h"
+
+// Slab allocator
+// A cache hands out fixed size objects. Objects are carved out of slabs (a 4kb page for small
+// objects, a 4MB huge page for big ones like kernel stacks) from the kernel heap window.
+// Every slab starts with a slab_t header and is aligned to its own size, so finding the slab
+// an object belongs to is just masking its address. Allocating and freeing are O(1).
+
+struct slab_cache_t;
+
+// Header at the start of every slab
+typedef struct slab_t {
+    struct slab_t *next;
+    struct slab_t *prev;
+    struct slab_cache_t *cache;
+
+    // Free objects in this slab, linked through their first word:
+    void *free_list;
+    uint32_t num_in_use;
+} slab_t;
+
+typedef struct slab_cache_t {
+    char *name;
+    size_t obj_size;
+    size_t slab_size;
+    uint32_t objs_per_slab;
+
+    // Offset of the first object from the start of a slab:
+    size_t first_obj;
+
+    // Slabs with at least one free object (the empty ones stay here too):
+    slab_t *partial;
+
+    // Slabs with nothing left:
+    slab_t *full;
+
+    // Stats:
+    uint32_t num_slabs;
+    uint32_t num_in_use;
+} slab_cache_t;
+
+/*
+ * slab_cache_init
+ *
+ * Setup a cache of obj_size byte objects, each aligned to align bytes (a power of 2).
+ * Objects bigger than an eighth of a page get huge page slabs.
+ */
+void slab_cache_init(slab_cache_t *cache, char *name, size_t obj_size, size_t align);
+
+// Same, but pick the slab size (PAGE_SIZE or HUGE_PAGE_SIZE) yourself
+void slab_cache_init_size(slab_cache_t *cache, char *name, size_t obj_size, size_t align, size_t slab_size);
+
+// Allocate an object (NULL if out of memory). Contents are not cleared.
+void *slab_alloc(slab_cache_t *cache);
+
+// Give an object back to the cache it came from
+void slab_free(slab_cache_t *cache, void *obj);
+
+#endif
@@ -8,6 +8,7 @@
 #include "system.h"
 #include "sandbox.h"
 #include "interrupt.h"
+#include "clock.h"
 
 typeable typeable_syscall = {
     .putc=typeable_putc_default,
@@ -27,8 +28,16 @@ typeable typeable_syscall = {
 };
 
 // Ensure pointers are userspace pointers:
-static inline bool _is_user_pointer (uint32_t ptr) {
-    return (DIR_IDX(ptr) == DIR_IDX(PROC_VIRT_ADDR));
+// All len bytes have to be somewhere in the process's memory (and readable)
+// Strings don't have a length up front, so those only check the first byte (running off the end still
+// only kills the process, see page_fault_handler)
+static inline bool _is_user_pointer (uint32_t ptr, size_t len) {
+    return vma_range_ok(current_proc->vmas, ptr, len, VMA_READ);
+}
+
+// Same, for buffers the kernel writes to (text pages are shared with every other process running the binary)
+static inline bool _is_user_writeable_pointer (uint32_t ptr, size_t len) {
+    return vma_range_ok(current_proc->vmas, ptr, len, VMA_WRITE);
 }
 
 // Kill a misbehaving process
@@ -65,7 +74,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
         }
         if (sandbox_level == SANDBOX_2) {
             // Enforce sandbox level 2 here
-            if (syscall_num == SYS_SWITCHUSER || syscall_num == SYS_GETUSER || syscall_num == SYS_MMAP || syscall_num == SYS_REMOTE_SWITCHUSER) {
+            if (syscall_num == SYS_SWITCHUSER || syscall_num == SYS_GETUSER || syscall_num == SYS_MMAP || syscall_num == SYS_MUNMAP || syscall_num == SYS_BRK || syscall_num == SYS_REMOTE_SWITCHUSER) {
                 return _sandbox_deny();
             }
         }
@@ -97,7 +106,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
         // Execute a new child process:
         case SYS_EXEC:
         //@TODO: copy_from_user
-        if (_is_user_pointer((uint32_t)arg1)) {
+        if (_is_user_pointer((uint32_t)arg1, 1)) {
             return sysexec((char *)arg1);
         }
         else {
@@ -111,7 +120,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
          */
         case SYS_OPEN:
         // @TODO: copy_from_user
-        if (_is_user_pointer((uint32_t)arg1)) {
+        if (_is_user_pointer((uint32_t)arg1, 1)) {
             return sysopen((char *)arg1);
         }
         else {
@@ -126,7 +135,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
 
         case SYS_READ:
         // @TODO: copy_from_user
-        if (_is_user_pointer(arg2)) {
+        if (_is_user_writeable_pointer(arg2, arg3)) {
             return sysread(fd, (char *)arg2, (size_t)arg3);
         }
         else {
@@ -137,7 +146,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
 
         case SYS_WRITE:
         // @TODO: copy_from_user
-        if (_is_user_pointer(arg2)) {
+        if (_is_user_pointer(arg2, arg3)) {
             return syswrite(fd, (char *)arg2, (size_t)arg3);
         }
         else {
@@ -148,7 +157,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
 
         // Throw a popup on the screen:
         case SYS_ALERT:
-        if (_is_user_pointer(arg1)) {
+        if (_is_user_pointer(arg1, 1)) {
             sys_alert((char *)arg1);
             return 0;
         }
@@ -189,7 +198,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
 
         case SYS_SWITCHUSER:
         // @TODO: ENSURE THESE BUFFERS ARE IN USER MEMORY AND NOT KERNEL MEMORY!!!!
-        if (_is_user_pointer(arg1) && _is_user_pointer(arg2)) {
+        if (_is_user_pointer(arg1, 1) && _is_user_pointer(arg2, 1)) {
             return sysswitchuser((char *)arg1, (char *)arg2);
         }
         else {
@@ -200,7 +209,7 @@ int32_t syscall (uint32_t syscall_num, ...) {
 
         case SYS_GETUSER:
         // @TODO: ENSURE THESE BUFFERS ARE IN USER MEMORY AND NOT KERNEL MEMORY!!!!
-        if (_is_user_pointer(arg1) && _is_user_pointer(arg3)) {
+        if (_is_user_writeable_pointer(arg1, arg2) && _is_user_writeable_pointer(arg3, sizeof(uid_t))) {
             return sysgetuser((char *)arg1, (size_t)arg2, (uid_t *)arg3);
         }
         else {
@@ -215,7 +224,30 @@ int32_t syscall (uint32_t syscall_num, ...) {
         break;
 
         case SYS_MMAP:
-        return sys_mmap();
+        return sys_mmap(arg1, arg2, arg3);
+        break;
+
+        case SYS_MUNMAP:
+        return sys_munmap(arg1, arg2);
+        break;
+
+        case SYS_FORK:
+        return sys_fork();
+        break;
+
+        case SYS_BRK:
+        return sys_brk(arg1);
+        break;
+
+        case SYS_CLOCK_GETTIME:
+        // @TODO: copy_to_user
+        if (_is_user_writeable_pointer(arg2, sizeof(timespec_t))) {
+            return sys_clock_gettime(arg1, (timespec_t *)arg2);
+        }
+        else {
+            _kill_misbehaving();
+            return -1;
+        }
         break;
 
         case SYS_SANDBOX_EXIT:
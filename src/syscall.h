@@ -2,11 +2,13 @@
 #define SYSCALL_H
 #include "types.h"
 #include "user.h"
+#include "clock.h"
 
 #define SYSCALL_INT_NUM ((0x80))
 
 extern int32_t do_syscall(uint32_t syscall_num, uint32_t arg1, uint32_t arg2);
 extern int32_t syscall_entry(void);
+extern void fork_child_entry(void);
 
 // Syscall numbers
 // Process operations
@@ -38,6 +40,18 @@ extern int32_t syscall_entry(void);
 // Sandbox related
 #define SYS_SANDBOX_EXIT 14
 
+// Time related
+#define SYS_CLOCK_GETTIME 15
+
+// Memory related (continued)
+#define SYS_MUNMAP 16
+
+// Process operations (continued)
+#define SYS_FORK 17
+
+// Memory related (continued)
+#define SYS_BRK 18
+
 // @TODO: STANDARDIZE KERNEL ERROR TYPES!
 // typedef int32_t kern_err_t; or something. Needs to be signed!
 
@@ -148,11 +162,40 @@ int32_t sys_remote_switchuser(uint32_t pid);
 /*
  * mmap
  *
- * Request another page of memory to do whatever with.
+ * Request len bytes of memory with protections prot, near addr_hint if that's free.
+ * len = 0 grants the original single huge page at MMAP_VIRT_ADDR (only once per process).
+ * This returns the virtual address of the new memory (or 0 if unsuccessful).
+ */
+uint32_t sys_mmap (uint32_t addr_hint, uint32_t len, uint32_t prot);
+
+/*
+ * munmap
+ *
+ * Give back memory from mmap. Returns 0 on success, -1 on failure.
+ */
+int32_t sys_munmap (uint32_t addr, uint32_t len);
+
+/*
+ * fork
+ *
+ * Clone the calling process. Returns the child's PID to the parent and 0 to the child, -1 on failure.
+ */
+int32_t sys_fork (void);
+
+/*
+ * brk
+ *
+ * Move the end of the heap to new_brk (0 just returns where it is).
+ * Returns the new end of the heap, or the old one if it couldn't be moved.
+ */
+uint32_t sys_brk (uint32_t new_brk);
+
+/*
+ * sys_clock_gettime
  *
- * This will grant a single huge page, and can only grant 1 page per process.
- * This returns the virtual address of the new huge page (or 0 if unsuccessful).
+ * Read the time on a clock (only CLOCK_MONOTONIC for now) into a user timespec.
+ * Defined in clock.c. Userspace can also read the time page instead (see clock.h).
  */
-uint32_t sys_mmap ();
+int32_t sys_clock_gettime (uint32_t clock_id, timespec_t *ts);
 
 #endif
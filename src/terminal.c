@@ -2,6 +2,7 @@
 #include "keymap.h"
 #include "vga.h"
 #include "util.h"
+#include "scheduler.h"
 #include "envconfig.h"
 #include "gui.h"
 
@@ -485,7 +486,7 @@ size_t terminal_read (typeable *t, char *readbuf, size_t bytes_to_read) {
     memset(t->buf, '\0', sizeof(t->buf));
     t->reading = true;
 
-    while (t->reading) { asm volatile ("hlt"); /* Gracefully wait for interrupt. Could also use scheduler_pass here */ }
+    sched_wait_flag(&t->reading); // Off the run queue until enter is pressed
 
     // User has pressed enter, so put buffer into readbuf
     bytes_to_copy = bytes_to_read;
@@ -0,0 +1,181 @@
+#include "timer.h"
+#include "util.h"
+#include "pit.h"
+
+#define TIMER_WHEEL_MASK ((TIMER_WHEEL_SLOTS - 1))
+
+// Each slot is a list sorted by expiry:
+static timer_t *timer_wheel[TIMER_WHEEL_SLOTS];
+
+// Tick the wheel is currently at (everything up to and including this has been run):
+static uint32_t timer_now = 0;
+
+// Number of pending timers:
+static uint32_t timer_count = 0;
+
+// Is a before b? (Deadlines wrap, so compare the difference)
+static inline bool _timer_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static inline void _timer_unlink(timer_t *timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    }
+    else {
+        timer_wheel[timer->expires & TIMER_WHEEL_MASK] = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->pending = false;
+    timer_count--;
+}
+
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    uint32_t hz = pit_get_frequency();
+
+    // Split up so ms * hz can't overflow for long timeouts:
+    return (ms / 1000) * hz + ((ms % 1000) * hz + 999) / 1000;
+}
+
+// Put timer in the wheel to go off ticks ticks from now (interrupts off)
+static void _timer_insert(timer_t *timer, uint32_t ticks) {
+    // Always at least the next tick:
+    if (ticks == 0) ticks = 1;
+
+    timer->expires = timer_now + ticks;
+    timer->pending = true;
+
+    // Sorted insert into the slot:
+    timer_t **link = &timer_wheel[timer->expires & TIMER_WHEEL_MASK];
+    timer_t *prev = NULL;
+    while (NULL != *link && !_timer_before(timer->expires, (*link)->expires)) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    timer->next = *link;
+    timer->prev = prev;
+    if (timer->next) {
+        timer->next->prev = timer;
+    }
+    *link = timer;
+    timer_count++;
+}
+
+void timer_add(timer_t *timer, uint32_t ms, timer_callback_t callback, void *data) {
+    if (!timer) return;
+    uint32_t flags = cli_and_save();
+
+    if (timer->pending) {
+        _timer_unlink(timer);
+    }
+
+    timer->callback = callback;
+    timer->data = data;
+    _timer_insert(timer, timer_ms_to_ticks(ms));
+
+    restore_flags(flags);
+}
+
+bool timer_cancel(timer_t *timer) {
+    if (!timer) return false;
+    uint32_t flags = cli_and_save();
+
+    bool was_pending = timer->pending;
+    if (was_pending) {
+        _timer_unlink(timer);
+    }
+
+    restore_flags(flags);
+    return was_pending;
+}
+
+void timer_run(uint32_t ticks) {
+    uint32_t flags = cli_and_save();
+
+    while (ticks > 0) {
+        timer_now++;
+        ticks--;
+
+        // Slot is sorted, so stop at the first one that is for a later lap of the wheel
+        timer_t **slot = &timer_wheel[timer_now & TIMER_WHEEL_MASK];
+        while (NULL != *slot && !_timer_before(timer_now, (*slot)->expires)) {
+            timer_t *timer = *slot;
+            _timer_unlink(timer);
+
+            // The callback is free to re-arm the timer
+            if (timer->callback) {
+                timer->callback(timer->data);
+            }
+        }
+    }
+
+    restore_flags(flags);
+}
+
+void timer_rescale(uint32_t old_hz, uint32_t new_hz) {
+    if (old_hz == 0 || old_hz == new_hz) return;
+    uint32_t flags = cli_and_save();
+    timer_t *pulled = NULL;
+    uint32_t i;
+
+    // Take everything out, remembering how many (old) ticks each one had left in expires:
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        while (NULL != timer_wheel[i]) {
+            timer_t *timer = timer_wheel[i];
+            uint32_t left = timer->expires - timer_now;
+            _timer_unlink(timer);
+            timer->expires = left;
+            timer->next = pulled;
+            pulled = timer;
+        }
+    }
+
+    // And back in at the new rate (rounded up so nothing goes off early):
+    while (NULL != pulled) {
+        timer_t *timer = pulled;
+        pulled = timer->next;
+        timer->next = NULL;
+        _timer_insert(timer, div_u64_u32((uint64_t)timer->expires * new_hz + old_hz - 1, old_hz, NULL));
+    }
+
+    restore_flags(flags);
+}
+
+uint32_t timer_ticks_until_next() {
+    uint32_t flags = cli_and_save();
+    uint32_t best = TIMER_NONE;
+    uint32_t i;
+
+    if (timer_count != 0) {
+        // The first slot (in order from now) whose head expires this lap has the earliest timer.
+        // Otherwise everything is at least a lap away; take the smallest head.
+        for (i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+            timer_t *head = timer_wheel[(timer_now + i) & TIMER_WHEEL_MASK];
+            if (NULL == head) continue;
+
+            uint32_t until = head->expires - timer_now;
+            if (until == i) {
+                best = until;
+                break;
+            }
+            if (until < best) best = until;
+        }
+    }
+
+    restore_flags(flags);
+    return best;
+}
+
+// Setup an empty wheel
+void init_timers() {
+    uint32_t i;
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        timer_wheel[i] = NULL;
+    }
+    timer_now = 0;
+    timer_count = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include "types.h"
+
+// Kernel timers
+// Driven by the PIT tick (see scheduler_tick), kept in a hashed timer wheel:
+// a timer lands in slot (expires % TIMER_WHEEL_SLOTS), and each slot is sorted by expiry,
+// so every tick only looks at the timers that actually expire (plus one).
+
+// Number of buckets in the wheel (power of 2):
+#define TIMER_WHEEL_SLOTS ((256))
+
+// Called (from interrupt context, interrupts off) when a timer expires
+typedef void (*timer_callback_t)(void *data);
+
+// Storage is provided by the caller (embed it in whatever it times out)
+typedef struct timer_t {
+    struct timer_t *next;
+    struct timer_t *prev;
+
+    // PIT tick this goes off on:
+    uint32_t expires;
+
+    timer_callback_t callback;
+    void *data;
+
+    // Is this timer in the wheel?
+    bool pending;
+} timer_t;
+
+// Setup an empty wheel
+void init_timers(void);
+
+/*
+ * timer_add
+ *
+ * Arm timer to call callback(data) in ms milliseconds (rounded up to a whole tick).
+ * If the timer was already pending it is re-armed with the new deadline.
+ */
+void timer_add(timer_t *timer, uint32_t ms, timer_callback_t callback, void *data);
+
+/*
+ * timer_cancel
+ *
+ * Take a timer out of the wheel without running it.
+ * Returns true if it was pending.
+ */
+bool timer_cancel(timer_t *timer);
+
+/*
+ * timer_run
+ *
+ * Account for ticks PIT ticks having passed (called by scheduler_tick)
+ * and run the callback of everything that expired.
+ */
+void timer_run(uint32_t ticks);
+
+/*
+ * timer_ticks_until_next
+ *
+ * Number of ticks until the next timer goes off. At least 1: timer_run has already run
+ * everything that was due.
+ * Returns TIMER_NONE if there are no timers.
+ */
+#define TIMER_NONE ((0xFFFFFFFF))
+uint32_t timer_ticks_until_next(void);
+
+/*
+ * timer_rescale
+ *
+ * The PIT is changing from old_hz to new_hz (called by pit_set_frequency):
+ * move every pending timer so it still goes off after the same amount of real time.
+ */
+void timer_rescale(uint32_t old_hz, uint32_t new_hz);
+
+// Convert ms to PIT ticks at the current tick rate (rounded up)
+uint32_t timer_ms_to_ticks(uint32_t ms);
+
+#endif
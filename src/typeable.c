@@ -2,6 +2,7 @@
 #include "vga.h"
 #include "keymap.h"
 #include "util.h"
+#include "scheduler.h"
 #include "gui.h"
 
 // The current typeable object (all keyboard interrupts write here):
@@ -200,7 +201,7 @@ size_t typeable_read_default (typeable *t, char *readbuf, size_t bytes_to_read)
     size_t bytes_to_copy;
 
     t->reading = 1;
-    while (t->reading) { asm volatile("hlt"); /* Nicely wait for next interrupt */ }
+    sched_wait_flag(&t->reading); // Off the run queue until enter is pressed
     // User has pressed enter, so put buffer into readbuf
     bytes_to_copy = bytes_to_read;
     if (bytes_to_copy > TYPEABLE_BUF_LEN) { bytes_to_copy = TYPEABLE_BUF_LEN; }
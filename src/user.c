@@ -533,19 +533,19 @@ int32_t sysgetuser (char *name, size_t name_size, uid_t *id) {
  * Privilege level: lower UID = more privileged
  */
 int32_t sys_remote_switchuser(uint32_t pid) {
-    if (pid < 0 || pid > MAX_PROCESSES) return -1;
-    if (!processes[pid].in_use) return -1;
-    if (processes[pid].uid <= current_proc->uid) return -2;
+    pcb_t *process = pid_to_pcb(pid);
+    if (!process) return -1;
+    if (process->uid <= current_proc->uid) return -2;
 
     // We are gonna elevate privileges so forget the sandbox level:
     #ifdef UIUCTF
-    if (processes[pid].uid == SANDBOX_USER) {
+    if (process->uid == SANDBOX_USER) {
         sandbox_level = SANDBOX_NONE;
         current_typeable_printf("uiuctf{translation_l00kas1d3_what_aga1n?}");
     }
     #endif
 
-    processes[pid].uid = current_proc->uid;
+    process->uid = current_proc->uid;
 
     // This is technically not correct, we should call this on the process when it gets
     // scheduled, but whatever this works:
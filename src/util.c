@@ -66,7 +66,7 @@ bool _strncmp_timing_side_channel (const char *str1, const char *str2, size_t ma
     while (i < max_bytes) {
         if (str1[i] != str2[i]) return false;
         if (str1[i] == '\0') return true;
-        process_sleep(2);
+        process_sleep(1000);
         i++;
     }
 
@@ -158,6 +158,31 @@ static inline void _snprintf(char *dest, size_t max_bytes, char *format, uint32_
                 arg++;
                 continue;
             }
+            else if (*idx == 'd' || *idx == 'D' || *idx == 'u' || *idx == 'U') {
+                // Treat *arg as a decimal number (signed for %d, unsigned for %u)
+                uint32_t arg_val = *arg;
+                if ((*idx == 'd' || *idx == 'D') && (int32_t)arg_val < 0) {
+                    _snprintf_putc(dest, max_bytes, &cur_byte, '-');
+                    arg_val = 0 - arg_val;
+                }
+                char digits[10];
+                int num_digits = 0;
+                do {
+                    digits[num_digits++] = (arg_val % 10) + 0x30;
+                    arg_val = arg_val / 10;
+                } while (arg_val != 0);
+
+                while (num_digits > 0) {
+                    num_digits--;
+                    _snprintf_putc(dest, max_bytes, &cur_byte, digits[num_digits]);
+                }
+
+                // Move to next argument:
+                is_special_code = false;
+                should_print_preleading_zeroes = false;
+                arg++;
+                continue;
+            }
             else if (*idx == '0') {
                 // This means preprint the leading zeroes
                 should_print_preleading_zeroes = true;
@@ -50,6 +50,29 @@ static inline void restore_flags(uint32_t flags) {
     );
 }
 
+// Read the timestamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// 64 bit by 32 bit divide (there is no libgcc to do this for us)
+// The quotient has to fit in 32 bits, or this will #DE
+static inline uint32_t div_u64_u32(uint64_t n, uint32_t d, uint32_t *rem) {
+    uint32_t q, r;
+    asm ("divl %4" : "=a"(q), "=d"(r) : "a"((uint32_t)n), "d"((uint32_t)(n >> 32)), "rm"(d));
+    if (rem) *rem = r;
+    return q;
+}
+
+// (a * mult) >> shift without overflowing 64 bits (shift <= 32)
+static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mult, uint32_t shift) {
+    uint64_t lo = ((uint64_t)(uint32_t)a * mult) >> shift;
+    uint64_t hi = ((uint64_t)(uint32_t)(a >> 32) * mult) << (32 - shift);
+    return hi + lo;
+}
+
 #define sti() asm volatile("sti");
 
 /* Be careful with this one: */
@@ -63,6 +86,7 @@ int strlen(char *str);
 
 size_t strncpy(char *to, const char *from, size_t max_bytes);
 size_t memcpy(void *to, void *from, size_t max_bytes);
+size_t memcpyl(uint32_t *to, uint32_t *from, size_t max_integers);
 size_t memset(char *to, char val, size_t max_bytes);
 size_t memsetl(void *to, uint32_t val, size_t max_bytes);
 
@@ -75,6 +99,7 @@ bool _strncmp_timing_side_channel (const char *str1, const char *str2, size_t ma
 #endif
 
 // snprintf- format a string into another string buffer
+// Supports %x (hex), %d (signed decimal), %u (unsigned decimal), %s and %c
 void snprintf (char *dest, size_t max_bytes, char *format, ...);
 
 // snprintf_unsafe- format a string into another string buffer
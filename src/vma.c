@@ -0,0 +1,364 @@
+#include "vma.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "zpool.h"
+#include "util.h"
+
+// Round x up to a multiple of align (a power of 2)
+#define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+
+vma_t *vma_find(vma_t *list, uint32_t addr) {
+    for (; list; list = list->next) {
+        if (addr < list->start) return NULL;
+        if (addr < list->end) return list;
+    }
+    return NULL;
+}
+
+bool vma_range_ok(vma_t *list, uint32_t start, uint32_t len, uint32_t flags) {
+    if (len == 0) len = 1;
+    if (start + len < start) return false;
+    uint32_t end = start + len;
+
+    // Areas are sorted, so walk them as long as each picks up right where the last one left off
+    vma_t *vma = vma_find(list, start);
+    while (vma) {
+        if ((vma->flags & flags) != flags) return false;
+        if (end <= vma->end) return true;
+        if (!vma->next || vma->next->start != vma->end) return false;
+        vma = vma->next;
+    }
+    return false;
+}
+
+// Does [start, end) overlap any area in list?
+static bool _vma_overlaps(vma_t *list, uint32_t start, uint32_t end) {
+    for (; list && list->start < end; list = list->next) {
+        if (list->end > start) return true;
+    }
+    return false;
+}
+
+uint32_t vma_find_free(vma_t *list, uint32_t hint, uint32_t len, uint32_t align, uint32_t lo, uint32_t hi) {
+    if (0 == len || lo >= hi || len > hi - lo) return 0;
+
+    if (hint && !(hint & (align - 1)) && hint >= lo && hint <= hi - len) {
+        if (!_vma_overlaps(list, hint, hint + len)) return hint;
+    }
+
+    // First gap that fits (the list is sorted):
+    uint32_t cursor = ALIGN_UP(lo, align);
+    for (; list; list = list->next) {
+        if (list->end <= cursor) continue;
+        if (cursor + len <= list->start) break;
+        cursor = ALIGN_UP(list->end, align);
+    }
+    if (cursor >= hi || hi - cursor < len) return 0;
+    return cursor;
+}
+
+// Unmap [start, end) of an area and free the memory behind it
+static void _vma_release(addr_space_t *as, uint32_t start, uint32_t end, uint32_t flags) {
+    uint32_t addr;
+    if (flags & VMA_HUGE) {
+        for (addr = start; addr < end; addr += HUGE_PAGE_SIZE) {
+            uint32_t phys = as_unmap_huge_page(as, addr);
+            if (phys) free_huge_page((void *)phys);
+        }
+        return;
+    }
+
+    // Shared pages belong to the exec image, they're only unmapped
+    paging_batch_begin();
+    for (addr = start; addr < end; addr += PAGE_SIZE) {
+        uint32_t phys = as_unmap_page(as, addr);
+        if (phys && !(flags & VMA_SHARED)) pmm_free((void *)phys, 0);
+    }
+    paging_batch_end();
+}
+
+int32_t vma_map_file(vma_t **list, uint32_t start, uint32_t len, uint32_t flags, exec_image_t *exe) {
+    if (!list || 0 == len) return -1;
+    if ((flags & VMA_SHARED) && ((flags & VMA_WRITE) || !exe)) return -1;
+
+    uint32_t align = (flags & VMA_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    uint32_t end = start + len;
+    if ((start | len) & (align - 1)) return -1;
+    if (end < start) return -1;
+    if (_vma_overlaps(*list, start, end)) return -1;
+
+    vma_t *vma = kmalloc(sizeof(vma_t));
+    if (!vma) return -1;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->exe = exe;
+
+    // Keep the list sorted:
+    vma_t **link = list;
+    while (*link && (*link)->start < start) {
+        link = &(*link)->next;
+    }
+    vma->next = *link;
+    *link = vma;
+    return 0;
+}
+
+int32_t vma_map(vma_t **list, uint32_t start, uint32_t len, uint32_t flags) {
+    return vma_map_file(list, start, len, flags & ~(VMA_FILE | VMA_SHARED), NULL);
+}
+
+// Copy the 4kb page at virt (in the loaded address space) into a new frame (0 if out of memory)
+static uint32_t _vma_copy_page(uint32_t virt) {
+    void *copy = pmm_alloc(0);
+    if (!copy) return 0;
+
+    uint32_t flags = cli_and_save();
+    memcpyl(scratch_map_page(SCRATCH_SLOT_COPY, (uint32_t)copy), (uint32_t *)PAGE_ALIGN(virt), PAGE_SIZE / sizeof(uint32_t));
+    restore_flags(flags);
+    return (uint32_t)copy;
+}
+
+// Write to a page left read only by vma_fork
+static int32_t _vma_break_cow(addr_space_t *as, uint32_t addr) {
+    uint32_t page = PAGE_ALIGN(addr);
+    uint32_t phys = as_virt_to_phys(as, page);
+    if (!phys) return VMA_FAULT_BAD;
+
+    // Everyone else already made their own copy, so this one is all ours
+    if (!pmm_page_is_shared(phys)) {
+        return as_map_page(as, page, phys, true, true) ? VMA_FAULT_COW : VMA_FAULT_BAD;
+    }
+
+    uint32_t copy = _vma_copy_page(page);
+    if (!copy) return VMA_FAULT_BAD;
+    if (!as_map_page(as, page, copy, true, true)) {
+        pmm_free((void *)copy, 0);
+        return VMA_FAULT_BAD;
+    }
+
+    // Drops our reference to the shared one
+    pmm_free((void *)phys, 0);
+    return VMA_FAULT_COW;
+}
+
+int32_t vma_fault(addr_space_t *as, vma_t *list, uint32_t addr, uint32_t error_code) {
+    vma_t *vma = vma_find(list, addr);
+    if (!vma) return VMA_FAULT_BAD;
+    if (!(vma->flags & VMA_READ)) return VMA_FAULT_BAD;
+    if ((error_code & PF_ERR_WRITE) && !(vma->flags & VMA_WRITE)) return VMA_FAULT_BAD;
+
+    // Already mapped, so this is a protection violation
+    // The only ones we fix are writes to pages a fork left copy-on-write:
+    if (error_code & PF_ERR_PRESENT) {
+        if (!(error_code & PF_ERR_WRITE) || (vma->flags & (VMA_HUGE | VMA_SHARED))) return VMA_FAULT_BAD;
+        return _vma_break_cow(as, addr);
+    }
+
+    bool writeable = (vma->flags & VMA_WRITE) != 0;
+
+    if (vma->flags & VMA_HUGE) {
+        uint32_t phys = zpool_alloc_huge_page();
+        if (!phys) return VMA_FAULT_BAD;
+        if (!as_map_huge_page(as, DIR_ALIGN(addr), phys, true, writeable)) {
+            free_huge_page((void *)phys);
+            return VMA_FAULT_BAD;
+        }
+        return VMA_FAULT_ZERO;
+    }
+
+    if (vma->flags & VMA_SHARED) {
+        // Someone running the same binary may have read it in already, otherwise we do it for everyone
+        bool new;
+        uint32_t shared = exec_image_shared_page(vma->exe, PAGE_ALIGN(addr), &new);
+        if (!shared) return VMA_FAULT_BAD;
+        if (!as_map_page(as, addr, shared, true, false)) return VMA_FAULT_BAD;
+        return new ? VMA_FAULT_FILE : VMA_FAULT_SHARED;
+    }
+
+    void *phys;
+    if (vma->flags & VMA_FILE) {
+        phys = pmm_alloc(0);
+        if (!phys) return VMA_FAULT_BAD;
+
+        // Fill it in before it's mapped, so read only pages don't need a detour through writeable
+        uint32_t flags = cli_and_save();
+        elf_fill_page(vma->exe->file, &vma->exe->image, PAGE_ALIGN(addr), scratch_map_page(SCRATCH_SLOT_FILL, (uint32_t)phys));
+        restore_flags(flags);
+    }
+    else {
+        phys = (void *)zpool_alloc_page();
+        if (!phys) return VMA_FAULT_BAD;
+    }
+
+    if (!as_map_page(as, addr, (uint32_t)phys, true, writeable)) {
+        pmm_free(phys, 0);
+        return VMA_FAULT_BAD;
+    }
+    return (vma->flags & VMA_FILE) ? VMA_FAULT_FILE : VMA_FAULT_ZERO;
+}
+
+// Copy or share every page mapped in [vma->start, vma->end) of as into child_as
+static int32_t _vma_fork_pages(addr_space_t *as, vma_t *vma, addr_space_t *child_as) {
+    bool writeable = (vma->flags & VMA_WRITE) != 0;
+    uint32_t addr;
+
+    if (vma->flags & VMA_HUGE) {
+        // Copying 4MB on the first write would be as bad as doing it now
+        for (addr = vma->start; addr < vma->end; addr += HUGE_PAGE_SIZE) {
+            if (!as_virt_to_phys(as, addr)) continue;
+
+            void *copy = alloc_huge_page();
+            if (!copy) return -1;
+            uint32_t flags = cli_and_save();
+            memcpyl(scratch_map_huge_page((uint32_t)copy), (uint32_t *)addr, HUGE_PAGE_SIZE / sizeof(uint32_t));
+            restore_flags(flags);
+
+            if (!as_map_huge_page(child_as, addr, (uint32_t)copy, true, writeable)) {
+                free_huge_page(copy);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    int32_t retval = 0;
+    paging_batch_begin();
+    for (addr = vma->start; addr < vma->end; addr += PAGE_SIZE) {
+        uint32_t phys = as_virt_to_phys(as, addr);
+        if (!phys) continue;
+
+        if (vma->flags & VMA_SHARED) {
+            // Belongs to the exec image, both of us just map it
+            if (!as_map_page(child_as, addr, phys, true, false)) {
+                retval = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (!pmm_page_share(phys)) {
+            // Too many owners already, the child gets its own copy
+            phys = _vma_copy_page(addr);
+            if (!phys) {
+                retval = -1;
+                break;
+            }
+            if (!as_map_page(child_as, addr, phys, true, writeable)) {
+                pmm_free((void *)phys, 0);
+                retval = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (!as_map_page(child_as, addr, phys, true, false)) {
+            pmm_free((void *)phys, 0);
+            retval = -1;
+            break;
+        }
+
+        // Whoever writes first gets a copy
+        if (writeable) as_map_page(as, addr, phys, true, false);
+    }
+    paging_batch_end();
+    return retval;
+}
+
+int32_t vma_fork(addr_space_t *as, vma_t *list, addr_space_t *child_as, vma_t **child_list) {
+    if (!as || !child_as || !child_list) return -1;
+    vma_t **tail = child_list;
+
+    for (; list; list = list->next) {
+        vma_t *copy = kmalloc(sizeof(vma_t));
+        if (!copy) return -1;
+        *copy = *list;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+
+        if (0 != _vma_fork_pages(as, list, child_as)) return -1;
+    }
+    return 0;
+}
+
+int32_t vma_unmap(addr_space_t *as, vma_t **list, uint32_t start, uint32_t len) {
+    if (!as || !list || 0 == len) return 0;
+
+    uint32_t end = PAGE_ALIGN((start + len + PAGE_SIZE - 1));
+    start = PAGE_ALIGN(start);
+    if (end <= start) return -1;
+
+    vma_t **link = list;
+    while (*link && (*link)->start < end) {
+        vma_t *vma = *link;
+        if (vma->end <= start) {
+            link = &vma->next;
+            continue;
+        }
+
+        uint32_t cut_start = (start > vma->start) ? start : vma->start;
+        uint32_t cut_end = (end < vma->end) ? end : vma->end;
+        if (vma->flags & VMA_HUGE) {
+            cut_start = DIR_ALIGN(cut_start);
+            cut_end = DIR_ALIGN((cut_end + HUGE_PAGE_SIZE - 1));
+        }
+
+        if (cut_start > vma->start && cut_end < vma->end) {
+            // A hole in the middle, the part above it becomes its own area
+            vma_t *top = kmalloc(sizeof(vma_t));
+            if (!top) return -1;
+            top->start = cut_end;
+            top->end = vma->end;
+            top->flags = vma->flags;
+            top->exe = vma->exe;
+            top->next = vma->next;
+            vma->next = top;
+            vma->end = cut_start;
+            _vma_release(as, cut_start, cut_end, vma->flags);
+            return 0;
+        }
+
+        _vma_release(as, cut_start, cut_end, vma->flags);
+        if (cut_start == vma->start && cut_end == vma->end) {
+            *link = vma->next;
+            kfree(vma);
+            continue;
+        }
+
+        if (cut_start == vma->start) vma->start = cut_end;
+        else vma->end = cut_start;
+        link = &vma->next;
+    }
+    return 0;
+}
+
+int32_t vma_resize(addr_space_t *as, vma_t **list, uint32_t start, uint32_t new_end, uint32_t flags) {
+    if (!list || new_end < start || ((start | new_end) & (PAGE_SIZE - 1))) return -1;
+
+    vma_t *vma = vma_find(*list, start);
+    if (!vma) {
+        if (new_end == start) return 0;
+        return vma_map(list, start, new_end - start, flags);
+    }
+    if (vma->start != start) return -1;
+
+    // Shrinking (or staying put):
+    if (new_end <= vma->end) return vma_unmap(as, list, new_end, vma->end - new_end);
+
+    // Growing, the new pages get backed as they're touched like the rest:
+    if (vma->flags & VMA_HUGE) return -1;
+    if (vma->next && vma->next->start < new_end) return -1;
+    vma->end = new_end;
+    return 0;
+}
+
+void vma_destroy_all(addr_space_t *as, vma_t **list) {
+    if (!list) return;
+    while (*list) {
+        vma_t *vma = *list;
+        *list = vma->next;
+        _vma_release(as, vma->start, vma->end, vma->flags);
+        kfree(vma);
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef VMA_H
+#define VMA_H
+#include "types.h"
+#include "paging.h"
+#include "filesystem.h"
+#include "elf.h"
+#include "exec_cache.h"
+
+// Virtual memory areas
+// Every user process keeps a list (sorted by address) of the regions of its address space:
+// its ELF segments, its stack, and whatever it mapped with mmap. Each says where it is,
+// what the process may do with it, and what backs it.
+// Nothing is backed up front. The first touch of a page faults, and vma_fault fills it in:
+// from the ELF for file backed areas, with zeroes for everything else.
+// Small areas are backed by 4kb frames in the process's own page tables, huge ones by whole huge pages.
+// Read only areas of an ELF are the exception: they map the pages of its exec_image_t, which every
+// process running that binary shares.
+// After a fork, parent and child share their private 4kb pages too, mapped read only. The first write
+// to one copies it (copy-on-write), the last owner left just gets it back writeable.
+
+// Protections (same values as the prot argument of mmap)
+#define VMA_READ ((0x1))
+#define VMA_WRITE ((0x2))
+#define VMA_PROT_MASK ((VMA_READ | VMA_WRITE))
+
+// Backed by huge pages (start and end are 4MB aligned)
+#define VMA_HUGE ((0x10))
+
+// Backed by an ELF image (see elf_fill_page), not zeroes
+#define VMA_FILE ((0x20))
+
+// Backed by the shared pages of the ELF image (VMA_FILE, and never writeable)
+#define VMA_SHARED ((0x40))
+
+typedef struct vma_t {
+    // [start, end), page aligned
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+
+    // Where the contents come from (VMA_FILE only):
+    exec_image_t *exe;
+
+    struct vma_t *next;
+} vma_t;
+
+// Page fault error code bits (pushed by the CPU)
+#define PF_ERR_PRESENT ((0x1)) // Protection violation, not a missing page
+#define PF_ERR_WRITE ((0x2))
+#define PF_ERR_USER ((0x4))
+
+// What vma_fault did:
+#define VMA_FAULT_BAD ((-1)) // Not allowed (or out of memory), the process has to go
+#define VMA_FAULT_ZERO ((0)) // Mapped a zeroed page
+#define VMA_FAULT_FILE ((1)) // Mapped a page from the ELF
+#define VMA_FAULT_SHARED ((2)) // Mapped a shared page someone else already read in
+#define VMA_FAULT_COW ((3)) // Wrote to a page shared since a fork, it's ours now
+
+// Area containing addr (NULL if there isn't one)
+vma_t *vma_find(vma_t *list, uint32_t addr);
+
+/*
+ * vma_range_ok
+ *
+ * Is every byte of [start, start + len) in some area, and do all of those areas allow flags (VMA_READ/ VMA_WRITE)?
+ * For checking user buffers before the kernel touches them. len of 0 just checks start.
+ */
+bool vma_range_ok(vma_t *list, uint32_t start, uint32_t len, uint32_t flags);
+
+/*
+ * vma_find_free
+ *
+ * Find room for len bytes (a multiple of align) in [lo, hi), aligned to align.
+ * If [hint, hint + len) is free and aligned it's used, otherwise the lowest gap that fits.
+ * Returns the start address, or 0 if there's no room.
+ */
+uint32_t vma_find_free(vma_t *list, uint32_t hint, uint32_t len, uint32_t align, uint32_t lo, uint32_t hi);
+
+/*
+ * vma_map
+ *
+ * Add the area [start, start + len) to list (it's backed as it's touched).
+ * len has to be a multiple of PAGE_SIZE (HUGE_PAGE_SIZE with VMA_HUGE), and start aligned the same.
+ * Returns 0 on success, -1 if it overlaps another area or we ran out of memory.
+ */
+int32_t vma_map(vma_t **list, uint32_t start, uint32_t len, uint32_t flags);
+
+// Same, but backed by the pages of an ELF image (the caller has to hold a reference to exe as long as the area is around)
+int32_t vma_map_file(vma_t **list, uint32_t start, uint32_t len, uint32_t flags, exec_image_t *exe);
+
+/*
+ * vma_fault
+ *
+ * Handle a page fault at addr in as (which has to be loaded), error_code is from the CPU.
+ * If addr is in an area of list that allows the access, back that page and map it.
+ * Returns VMA_FAULT_ZERO/ FILE/ SHARED/ COW if the access can be retried, VMA_FAULT_BAD if not.
+ */
+int32_t vma_fault(addr_space_t *as, vma_t *list, uint32_t addr, uint32_t error_code);
+
+/*
+ * vma_resize
+ *
+ * Move the end of the area starting at start to new_end (page aligned). The area is made (with flags)
+ * if there isn't one yet, and goes away if new_end == start. Growing only works if nothing is in the way.
+ * Returns 0 on success, -1 on failure.
+ */
+int32_t vma_resize(addr_space_t *as, vma_t **list, uint32_t start, uint32_t new_end, uint32_t flags);
+
+/*
+ * vma_fork
+ *
+ * Copy every area of list (mapped in as, which has to be loaded) into child_list for child_as.
+ * Private 4kb pages end up shared copy-on-write, shared ELF pages are just mapped, huge pages are copied.
+ * Returns 0 on success, -1 if we ran out of memory (whatever made it into child_list still has to be
+ * freed with vma_destroy_all).
+ */
+int32_t vma_fork(addr_space_t *as, vma_t *list, addr_space_t *child_as, vma_t **child_list);
+
+/*
+ * vma_unmap
+ *
+ * Unmap [start, start + len) and free whatever backed it. Areas hanging over either end are split.
+ * Huge areas go in whole huge pages: touching any part of one unmaps all of it.
+ * Returns 0 on success (even if nothing was mapped there), -1 if we couldn't split an area.
+ */
+int32_t vma_unmap(addr_space_t *as, vma_t **list, uint32_t start, uint32_t len);
+
+// Unmap and free every area in list (when the process goes away)
+void vma_destroy_all(addr_space_t *as, vma_t **list);
+
+#endif
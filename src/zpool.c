@@ -0,0 +1,175 @@
+#include "zpool.h"
+#include "pmm.h"
+#include "paging.h"
+#include "util.h"
+
+// Zeroed frames/ huge pages, ready to go (physical addresses, used as stacks):
+static uint32_t zpool_pages[ZPOOL_PAGES];
+static uint32_t zpool_num_pages = 0;
+static uint32_t zpool_huge_pages[ZPOOL_HUGE_PAGES];
+static uint32_t zpool_num_huge_pages = 0;
+
+// Huge page the idle loop is partway through zeroing (0 if none), and how much of it is done:
+static uint32_t zpool_huge_partial = 0;
+static uint32_t zpool_huge_partial_done = 0;
+
+// Set when a refill couldn't get memory (or the pools were drained), along with how much was free then.
+// The idle loop stops refilling until something gets freed, rather than spinning on allocations that keep failing.
+static bool zpool_starved = false;
+static uint32_t zpool_starved_free = 0;
+
+// Stats:
+static uint32_t zpool_page_hits = 0;
+static uint32_t zpool_page_misses = 0;
+static uint32_t zpool_huge_hits = 0;
+static uint32_t zpool_huge_misses = 0;
+static uint32_t zpool_refilled_kb = 0;
+static uint32_t zpool_drained_kb = 0;
+
+// Stop refilling until more memory is free than there is right now (call with interrupts off)
+static inline void _zpool_starve() {
+    zpool_starved = true;
+    zpool_starved_free = pmm_free_bytes();
+}
+
+// Zero [offset, offset + PAGE_SIZE) of the memory at phys
+static inline void _zpool_zero(uint32_t phys, uint32_t offset) {
+    memsetl(scratch_map_page(SCRATCH_SLOT_ZERO, phys + offset), 0, PAGE_SIZE / sizeof(uint32_t));
+}
+
+uint32_t zpool_alloc_page() {
+    uint32_t flags = cli_and_save();
+    if (zpool_num_pages > 0) {
+        uint32_t phys = zpool_pages[--zpool_num_pages];
+        zpool_page_hits++;
+        restore_flags(flags);
+        return phys;
+    }
+    zpool_page_misses++;
+    restore_flags(flags);
+
+    void *phys = pmm_alloc(0);
+    if (phys) zero_page_phys((uint32_t)phys);
+    return (uint32_t)phys;
+}
+
+uint32_t zpool_alloc_huge_page() {
+    uint32_t flags = cli_and_save();
+    if (zpool_num_huge_pages > 0) {
+        uint32_t phys = zpool_huge_pages[--zpool_num_huge_pages];
+        zpool_huge_hits++;
+        restore_flags(flags);
+        return phys;
+    }
+    zpool_huge_misses++;
+
+    // Take over the one the idle loop started on, it's at least partly done
+    uint32_t phys = zpool_huge_partial;
+    uint32_t done = zpool_huge_partial_done;
+    zpool_huge_partial = 0;
+    zpool_huge_partial_done = 0;
+    restore_flags(flags);
+
+    if (!phys) {
+        phys = (uint32_t)alloc_huge_page();
+        if (!phys) return 0;
+        done = 0;
+    }
+    if (0 == done) {
+        zero_huge_page_phys(phys);
+        return phys;
+    }
+
+    flags = cli_and_save();
+    for (; done < HUGE_PAGE_SIZE; done += PAGE_SIZE) {
+        _zpool_zero(phys, done);
+    }
+    restore_flags(flags);
+    return phys;
+}
+
+bool zpool_needs_refill() {
+    if (zpool_starved) {
+        if (pmm_free_bytes() <= zpool_starved_free) return false;
+        zpool_starved = false;
+    }
+    return zpool_num_pages < ZPOOL_PAGES || zpool_num_huge_pages < ZPOOL_HUGE_PAGES;
+}
+
+void zpool_refill_step() {
+    uint32_t flags = cli_and_save();
+
+    // Small pages first, they're quick:
+    if (zpool_num_pages < ZPOOL_PAGES) {
+        void *phys = pmm_alloc_noreclaim(0);
+        if (phys) {
+            _zpool_zero((uint32_t)phys, 0);
+            zpool_pages[zpool_num_pages++] = (uint32_t)phys;
+            zpool_refilled_kb += PAGE_SIZE / 1024;
+        }
+        else {
+            _zpool_starve();
+        }
+        restore_flags(flags);
+        return;
+    }
+
+    if (zpool_num_huge_pages < ZPOOL_HUGE_PAGES) {
+        if (!zpool_huge_partial) {
+            zpool_huge_partial = (uint32_t)pmm_alloc_noreclaim(PMM_HUGE_ORDER);
+            zpool_huge_partial_done = 0;
+            if (!zpool_huge_partial) {
+                _zpool_starve();
+                restore_flags(flags);
+                return;
+            }
+        }
+
+        _zpool_zero(zpool_huge_partial, zpool_huge_partial_done);
+        zpool_huge_partial_done += PAGE_SIZE;
+        zpool_refilled_kb += PAGE_SIZE / 1024;
+
+        if (zpool_huge_partial_done == HUGE_PAGE_SIZE) {
+            zpool_huge_pages[zpool_num_huge_pages++] = zpool_huge_partial;
+            zpool_huge_partial = 0;
+            zpool_huge_partial_done = 0;
+        }
+    }
+    restore_flags(flags);
+}
+
+bool zpool_drain() {
+    uint32_t flags = cli_and_save();
+    uint32_t kb = 0;
+
+    while (zpool_num_pages > 0) {
+        pmm_free((void *)zpool_pages[--zpool_num_pages], 0);
+        kb += PAGE_SIZE / 1024;
+    }
+    while (zpool_num_huge_pages > 0) {
+        pmm_free((void *)zpool_huge_pages[--zpool_num_huge_pages], PMM_HUGE_ORDER);
+        kb += HUGE_PAGE_SIZE / 1024;
+    }
+    if (zpool_huge_partial) {
+        pmm_free((void *)zpool_huge_partial, PMM_HUGE_ORDER);
+        zpool_huge_partial = 0;
+        zpool_huge_partial_done = 0;
+        kb += HUGE_PAGE_SIZE / 1024;
+    }
+
+    // Whoever needed this memory gets first dibs, the idle loop waits for something else to be freed
+    _zpool_starve();
+    zpool_drained_kb += kb;
+    restore_flags(flags);
+    return kb > 0;
+}
+
+size_t zpool_report(char *buf, size_t size) {
+    char linebuf[256];
+    snprintf(linebuf, sizeof(linebuf),
+        "pages: %u/%u\npage hits: %u\npage misses: %u\nhuge pages: %u/%u\nhuge hits: %u\nhuge misses: %u\nzeroed in idle: %u kB\ndrained: %u kB%s\n",
+        zpool_num_pages, ZPOOL_PAGES, zpool_page_hits, zpool_page_misses,
+        zpool_num_huge_pages, ZPOOL_HUGE_PAGES, zpool_huge_hits, zpool_huge_misses, zpool_refilled_kb,
+        zpool_drained_kb, zpool_starved ? " (waiting for free memory)" : "");
+    return strncpy(buf, linebuf, size);
+}
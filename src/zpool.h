@@ -0,0 +1,45 @@
+#ifndef ZPOOL_H
+#define ZPOOL_H
+#include "types.h"
+
+// Pre-zeroed page pools
+// Memory handed to a process has to be zeroed first, and zeroing a 4MB huge page takes a while.
+// So a few 4kb pages and huge pages are kept zeroed ahead of time, and allocating one is just a pop.
+// The idle loop tops the pools back up whenever there's nothing else to run (see zpool_refill_step).
+// If a pool runs dry, the page is zeroed on the spot instead.
+// The pools only hold memory nobody's using yet, so pmm_alloc takes it back (zpool_drain) before giving up.
+
+// How many of each to keep ready:
+#define ZPOOL_PAGES ((64))
+#define ZPOOL_HUGE_PAGES ((2))
+
+// A zeroed 4kb frame (physical address), 0 if we're out of memory. Free with pmm_free(phys, 0)
+uint32_t zpool_alloc_page(void);
+
+// A zeroed huge page (physical address), 0 if we're out of memory. Free with free_huge_page
+uint32_t zpool_alloc_huge_page(void);
+
+// Is either pool below its target?
+// False after a refill ran out of memory (or a drain), until some more memory gets freed
+bool zpool_needs_refill(void);
+
+/*
+ * zpool_refill_step
+ *
+ * Zero one 4kb frame's worth of memory towards refilling the pools (huge pages take 1024 steps).
+ * Meant for the idle loop, with interrupts on: each step only keeps them off for a moment.
+ */
+void zpool_refill_step(void);
+
+/*
+ * zpool_drain
+ *
+ * Give every pooled page (and the half-zeroed huge page) back to the pmm, for when it's out of memory.
+ * Refilling waits until memory is freed again. Returns whether anything was given back.
+ */
+bool zpool_drain(void);
+
+// Pool hits vs. pages zeroed on the spot (for /proc/zpool), returns bytes written
+size_t zpool_report(char *buf, size_t size);
+
+#endif